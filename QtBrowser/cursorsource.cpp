@@ -0,0 +1,230 @@
+#include "cursorsource.h"
+#include <QBitmap>
+#include <QEvent>
+#include <QMutexLocker>
+#include <QPainter>
+#include <QPainterPath>
+#include <QTransform>
+
+static const int STANDARD_CURSOR_SIZE = 24;
+
+// black shape with a white rim, visible on any page
+static void drawOutlined(QPainter& p, const QPainterPath& path, bool filled) {
+    p.setBrush(Qt::NoBrush);
+    p.setPen(QPen(Qt::white, 3, Qt::SolidLine, Qt::SquareCap, Qt::MiterJoin));
+    p.drawPath(path);
+    p.setPen(QPen(Qt::black, 1, Qt::SolidLine, Qt::SquareCap, Qt::MiterJoin));
+    p.setBrush(filled ? QBrush(Qt::black) : QBrush(Qt::NoBrush));
+    p.drawPath(path);
+}
+
+// a double headed arrow across the origin, pointing left and right
+static QPainterPath doubleArrow(int halfLength) {
+    const int head = 4;
+    QPainterPath path;
+    path.moveTo(-halfLength, 0);
+    path.lineTo(-halfLength + head, -head);
+    path.lineTo(-halfLength + head, -1);
+    path.lineTo(halfLength - head, -1);
+    path.lineTo(halfLength - head, -head);
+    path.lineTo(halfLength, 0);
+    path.lineTo(halfLength - head, head);
+    path.lineTo(halfLength - head, 1);
+    path.lineTo(-halfLength + head, 1);
+    path.lineTo(-halfLength + head, head);
+    path.closeSubpath();
+    return path;
+}
+
+QImage CursorSource::standardCursorImage(Qt::CursorShape shape, QPoint& hotSpot) {
+    if (shape == Qt::BlankCursor) {
+        hotSpot = QPoint(0, 0);
+        QImage blank(1, 1, QImage::Format_ARGB32);
+        blank.fill(Qt::transparent);
+        return blank;
+    }
+
+    QImage image(STANDARD_CURSOR_SIZE, STANDARD_CURSOR_SIZE, QImage::Format_ARGB32);
+    image.fill(Qt::transparent);
+    QPainter p(&image);
+    const QPoint center(11, 11);
+
+    switch (shape) {
+    case Qt::IBeamCursor: {
+        hotSpot = center;
+        QPainterPath path;
+        path.moveTo(8, 3); path.lineTo(14, 3);
+        path.moveTo(11, 3); path.lineTo(11, 19);
+        path.moveTo(8, 19); path.lineTo(14, 19);
+        drawOutlined(p, path, false);
+        break;
+    }
+    case Qt::CrossCursor: {
+        hotSpot = center;
+        QPainterPath path;
+        path.moveTo(11, 2); path.lineTo(11, 20);
+        path.moveTo(2, 11); path.lineTo(20, 11);
+        drawOutlined(p, path, false);
+        break;
+    }
+    case Qt::SizeHorCursor:
+    case Qt::SplitHCursor:
+    case Qt::SizeVerCursor:
+    case Qt::SplitVCursor:
+    case Qt::SizeFDiagCursor:
+    case Qt::SizeBDiagCursor:
+    case Qt::SizeAllCursor: {
+        hotSpot = center;
+        QTransform transform = QTransform::fromTranslate(center.x(), center.y());
+        if (shape == Qt::SizeVerCursor || shape == Qt::SplitVCursor) transform.rotate(90);
+        else if (shape == Qt::SizeFDiagCursor) transform.rotate(45);
+        else if (shape == Qt::SizeBDiagCursor) transform.rotate(-45);
+        QPainterPath path = transform.map(doubleArrow(9));
+        if (shape == Qt::SizeAllCursor)
+            path = path.united(QTransform(transform).rotate(90).map(doubleArrow(9)));
+        drawOutlined(p, path, true);
+        break;
+    }
+    case Qt::WaitCursor:
+    case Qt::BusyCursor: {
+        hotSpot = center;
+        QPainterPath path;
+        path.addEllipse(QPointF(center), 8, 8);
+        path.addEllipse(QPointF(center), 4, 4);
+        drawOutlined(p, path, true);
+        break;
+    }
+    case Qt::ForbiddenCursor: {
+        hotSpot = center;
+        QPainterPath path;
+        path.addEllipse(QPointF(center), 8, 8);
+        path.moveTo(6, 6); path.lineTo(16, 16);
+        drawOutlined(p, path, false);
+        break;
+    }
+    case Qt::PointingHandCursor:
+    case Qt::OpenHandCursor:
+    case Qt::ClosedHandCursor: {
+        // a raised index finger over a palm, the tip is the hot spot
+        hotSpot = QPoint(7, 1);
+        QPainterPath path;
+        path.moveTo(6, 2); path.lineTo(8, 2); path.lineTo(8, 9);
+        path.lineTo(16, 10); path.lineTo(17, 12); path.lineTo(16, 18);
+        path.lineTo(14, 21); path.lineTo(8, 21); path.lineTo(3, 14);
+        path.lineTo(4, 12); path.lineTo(6, 13);
+        path.closeSubpath();
+        drawOutlined(p, path, true);
+        break;
+    }
+    default: {
+        // arrow, and the fallback for everything we don't draw ourselves
+        hotSpot = QPoint(1, 1);
+        QPainterPath path;
+        path.moveTo(1, 1); path.lineTo(1, 17); path.lineTo(5, 13); path.lineTo(8, 20);
+        path.lineTo(10, 19); path.lineTo(7, 12); path.lineTo(12, 12);
+        path.closeSubpath();
+        drawOutlined(p, path, true);
+        break;
+    }
+    }
+    return image;
+}
+
+// cursors made from a bitmap and a mask: bitmap 1 is black, 0 is white, mask 0 is clear
+static QImage bitmapCursorImage(const QCursor& cursor) {
+    const QImage bits = cursor.bitmap().toImage();
+    const QImage mask = cursor.mask().toImage();
+    QImage image(bits.size(), QImage::Format_ARGB32);
+    for (int y = 0; y < image.height(); ++y) {
+        QRgb* row = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            const bool visible = !mask.isNull() && mask.pixelIndex(x, y) == 1;
+            row[x] = !visible ? 0 : bits.pixelIndex(x, y) == 1 ? 0xff000000 : 0xffffffff;
+        }
+    }
+    return image;
+}
+
+CursorSource::CursorSource(QWidget* root, QObject* parent)
+    : QObject(parent),
+    m_root(root)
+{
+    if (m_root) {
+        watch(m_root);
+        update();
+    }
+}
+
+CursorPtr CursorSource::currentCursor() const {
+    QMutexLocker locker(&m_cursorMutex);
+    return m_cursor;
+}
+
+void CursorSource::watch(QWidget* widget) {
+    widget->installEventFilter(this);
+    const QList<QWidget*> children = widget->findChildren<QWidget*>(Qt::FindDirectChildrenOnly);
+    for (QWidget* child : children)
+        watch(child);
+}
+
+bool CursorSource::eventFilter(QObject* watched, QEvent* event) {
+    switch (event->type()) {
+    case QEvent::CursorChange:
+        // the page switching between pointer, text and so on. A change on a widget
+        // the pointer isn't over just compares equal in update() and goes nowhere
+        update();
+        break;
+    case QEvent::ChildAdded: {
+        QObject* child = static_cast<QChildEvent*>(event)->child();
+        if (child->isWidgetType())
+            watch(static_cast<QWidget*>(child));
+        break;
+    }
+    default:
+        break;
+    }
+    return QObject::eventFilter(watched, event);
+}
+
+void CursorSource::setPointerPosition(const QPoint& position) {
+    m_position = position;
+    if (!m_root) return;
+    QWidget* widget = m_root->childAt(position);
+    if (!widget) widget = m_root;
+    // moving around inside one widget can't change the cursor, only CursorChange can
+    if (widget != m_widget)
+        update();
+}
+
+void CursorSource::update() {
+    if (!m_root) return;
+    QWidget* widget = m_root->childAt(m_position);
+    if (!widget) widget = m_root;
+    m_widget = widget;
+
+    // cursor() falls back to the parents cursor, so this is what would be on screen
+    const QCursor cursor = widget->cursor();
+    const Qt::CursorShape shape = cursor.shape();
+    const QPixmap pixmap = cursor.pixmap();
+    qint64 pixmapKey = 0;
+    if (shape == Qt::BitmapCursor)
+        pixmapKey = pixmap.isNull() ? cursor.bitmap().cacheKey() : pixmap.cacheKey();
+    if (m_cursor && shape == m_shape && pixmapKey == m_pixmapKey) return;
+    m_shape = shape;
+    m_pixmapKey = pixmapKey;
+
+    QSharedPointer<CursorShape> next(new CursorShape);
+    if (shape == Qt::BitmapCursor) {
+        next->image = pixmap.isNull() ? bitmapCursorImage(cursor)
+                                      : pixmap.toImage().convertToFormat(QImage::Format_ARGB32);
+        next->hotSpot = cursor.hotSpot();
+    } else {
+        next->image = standardCursorImage(shape, next->hotSpot);
+    }
+    next->serial = m_cursor ? m_cursor->serial + 1 : 1;
+    {
+        QMutexLocker locker(&m_cursorMutex);
+        m_cursor = next;
+    }
+    emit cursorChanged(next);
+}
@@ -0,0 +1,65 @@
+#ifndef CURSORSOURCE_H
+#define CURSORSOURCE_H
+
+#include <QCursor>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QPoint>
+#include <QPointer>
+#include <QSharedPointer>
+#include <QWidget>
+
+// one cursor image, shared read only by every session like the frame snapshots
+struct CursorShape
+{
+    QImage image; // Format_ARGB32, alpha below 128 counts as transparent on the wire
+    QPoint hotSpot;
+    quint64 serial = 0;
+};
+
+using CursorPtr = QSharedPointer<const CursorShape>;
+
+// CursorSource follows the cursor the browser would show under the remote pointer, so
+// clients with the Cursor pseudo encoding can draw it themselves. Captures never
+// contain a cursor, so pointer motion costs no framebuffer updates at all, only a
+// shape change sends anything. It watches CursorChange on every widget of the captured
+// tree and re-checks whenever the pointer moves onto another widget
+class CursorSource : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit CursorSource(QWidget* root, QObject* parent = nullptr);
+
+    // safe to call from any thread
+    CursorPtr currentCursor() const;
+
+public slots:
+    // GUI thread, from the input injector
+    void setPointerPosition(const QPoint& position);
+
+signals:
+    void cursorChanged(const CursorPtr& cursor);
+
+protected:
+    bool eventFilter(QObject* watched, QEvent* event) override;
+
+private:
+    void watch(QWidget* widget);
+    void update();
+    // standard shapes have no pixmap in Qt, the platform draws them. We draw our own
+    static QImage standardCursorImage(Qt::CursorShape shape, QPoint& hotSpot);
+
+    QPointer<QWidget> m_root;
+    QPoint m_position;
+    QPointer<QWidget> m_widget; // under the pointer
+    // what the current shape was built from, to tell a real change from a repeat
+    Qt::CursorShape m_shape = Qt::ArrowCursor;
+    qint64 m_pixmapKey = 0;
+
+    mutable QMutex m_cursorMutex;
+    CursorPtr m_cursor;
+};
+
+#endif // CURSORSOURCE_H
@@ -0,0 +1,71 @@
+#include "damagetracker.h"
+#include <QChildEvent>
+#include <QPaintEvent>
+
+DamageTracker::DamageTracker(QWidget* root, QObject* parent)
+    : QObject(parent), m_root(root)
+{
+    if (m_root)
+        watch(m_root);
+}
+
+QRegion DamageTracker::takeDamage() {
+    QRegion damage = m_damage;
+    m_damage = QRegion();
+    return damage;
+}
+
+void DamageTracker::addDamage(const QRegion& region) {
+    if (!m_root || region.isEmpty()) return;
+
+    const bool wasEmpty = m_damage.isEmpty();
+    m_damage += region.intersected(m_root->rect());
+    if (wasEmpty && !m_damage.isEmpty())
+        emit damaged();
+}
+
+void DamageTracker::watch(QWidget* widget) {
+    widget->installEventFilter(this);
+    const QList<QWidget*> children = widget->findChildren<QWidget*>(Qt::FindDirectChildrenOnly);
+    for (QWidget* child : children)
+        watch(child);
+}
+
+void DamageTracker::addWidgetDamage(QWidget* widget, const QRegion& region) {
+    if (widget == m_root) {
+        addDamage(region);
+        return;
+    }
+    // widgets that got reparented out of the captured tree are no longer our business
+    if (!m_root->isAncestorOf(widget) || !widget->isVisible()) return;
+    addDamage(region.translated(widget->mapTo(m_root, QPoint(0, 0))));
+}
+
+bool DamageTracker::eventFilter(QObject* watched, QEvent* event) {
+    if (!m_root || !watched->isWidgetType())
+        return QObject::eventFilter(watched, event);
+
+    QWidget* widget = static_cast<QWidget*>(watched);
+    switch (event->type()) {
+    case QEvent::Paint:
+        if (!m_paused)
+            addWidgetDamage(widget, static_cast<QPaintEvent*>(event)->region());
+        break;
+    case QEvent::ChildAdded: {
+        // new tabs, popups and the web engine render widget show up after we start
+        QObject* child = static_cast<QChildEvent*>(event)->child();
+        if (child->isWidgetType())
+            watch(static_cast<QWidget*>(child));
+        break;
+    }
+    case QEvent::Resize:
+        if (widget == m_root) {
+            addDamage(m_root->rect());
+            emit resized(m_root->size());
+        }
+        break;
+    default:
+        break;
+    }
+    return QObject::eventFilter(watched, event);
+}
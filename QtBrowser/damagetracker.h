@@ -0,0 +1,45 @@
+#ifndef DAMAGETRACKER_H
+#define DAMAGETRACKER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QRegion>
+#include <QWidget>
+
+// DamageTracker watches every widget in the captured tree and records which parts
+// of the root actually repainted. The VNC server uses this instead of blindly pushing
+// full frames so static pages cost nothing and active ones go out as soon as they paint
+class DamageTracker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DamageTracker(QWidget* root, QObject* parent = nullptr);
+
+    // returns everything repainted since the last call and clears it
+    QRegion takeDamage();
+    bool hasDamage() const { return !m_damage.isEmpty(); }
+    void addDamage(const QRegion& region);
+
+    // our own grab() sends paint events through the whole tree, so the capture code
+    // pauses the tracker around it or we would feed ourselves damage forever
+    void setPaused(bool paused) { m_paused = paused; }
+
+signals:
+    // emitted once when damage goes from empty to non empty
+    void damaged();
+    void resized(const QSize& size);
+
+protected:
+    bool eventFilter(QObject* watched, QEvent* event) override;
+
+private:
+    void watch(QWidget* widget);
+    void addWidgetDamage(QWidget* widget, const QRegion& region);
+
+    QPointer<QWidget> m_root;
+    QRegion m_damage;
+    bool m_paused = false;
+};
+
+#endif // DAMAGETRACKER_H
@@ -0,0 +1,159 @@
+#include "encoderbenchmark.h"
+#include "hextileencoder.h"
+#include "zrleencoder.h"
+#include "tightencoder.h"
+#include "pixelformat.h"
+#include "rfboutput.h"
+#include "taskscheduler.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QList>
+#include <QThread>
+#include <memory>
+
+static const int BENCHMARK_TILE_SIZE = 64; // what the sessions cut updates into
+static const qint64 BENCHMARK_NSECS = 1000000000; // per encoder, at least
+static const int MIN_ROUNDS = 3;
+static const int BENCHMARK_QUALITY_LEVEL = 6; // for the lossy Tight run
+
+using EncodeFunction = void (*)(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                                OutgoingRect& out);
+
+// what a session does for a ZRLE tile: the tile data, then through the one stream
+static void encodeZrleRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                           OutgoingRect& out) {
+    static ZrleStream stream;
+    static OutgoingRect tiles;
+    tiles.reset();
+    encodeZrleTiles(image, rect, converter, tiles);
+    stream.deflateRect(rect, tiles, out);
+}
+
+// Tight the same way, lossless and at the middle QualityLevel
+static void encodeTight(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                        int jpegQualityLevel, OutgoingRect& out) {
+    static TightStreams streams;
+    static OutgoingRect data;
+    data.reset();
+    const TightTile tile = encodeTightRect(image, rect, converter, jpegQualityLevel, data);
+    if (tile.stream < 0)
+        out.append(data.buffer.constData(), data.buffer.size());
+    else
+        streams.deflateTile(tile, data, out);
+}
+
+static void encodeTightLosslessRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                                    OutgoingRect& out) {
+    encodeTight(image, rect, converter, -1, out);
+}
+
+static void encodeTightJpegRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                                OutgoingRect& out) {
+    encodeTight(image, rect, converter, BENCHMARK_QUALITY_LEVEL, out);
+}
+
+// the worker half of a Tight tile, what a session hands to the scheduler
+static void encodeTightTileRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                                OutgoingRect& out) {
+    encodeTightRect(image, rect, converter, -1, out);
+}
+
+static QList<QRect> frameTiles(const QImage& frame) {
+    QList<QRect> tiles;
+    for (int y = 0; y < frame.height(); y += BENCHMARK_TILE_SIZE) {
+        for (int x = 0; x < frame.width(); x += BENCHMARK_TILE_SIZE) {
+            tiles.append(QRect(x, y, qMin(BENCHMARK_TILE_SIZE, frame.width() - x),
+                               qMin(BENCHMARK_TILE_SIZE, frame.height() - y)));
+        }
+    }
+    return tiles;
+}
+
+void benchmarkEncoders(const QImage& frame) {
+    const QList<QRect> tiles = frameTiles(frame);
+    // raw is the yardstick: a rectangle header and 4 bytes per pixel
+    const qint64 rawBytes = qint64(frame.width()) * frame.height() * 4 + qint64(tiles.size()) * 12;
+    qDebug().nospace() << "[Server] encoder benchmark on a " << frame.width() << "x" << frame.height()
+                       << " frame, " << tiles.size() << " tiles, raw " << rawBytes << " bytes";
+
+    struct Encoder { const char* name; EncodeFunction encode; };
+    const Encoder encoders[] = {
+        { "hextile", encodeHextileRect },
+        { "zrle", encodeZrleRect },
+        { "tight", encodeTightLosslessRect },
+        { "tight jpeg", encodeTightJpegRect },
+    };
+
+    const PixelConverter converter;
+    OutgoingRect out;
+    for (const Encoder& encoder : encoders) {
+        qint64 encodedBytes = 0;
+        int rounds = 0;
+        QElapsedTimer timer;
+        timer.start();
+        while (rounds < MIN_ROUNDS || timer.nsecsElapsed() < BENCHMARK_NSECS) {
+            encodedBytes = 0;
+            for (const QRect& tile : std::as_const(tiles)) {
+                out.reset();
+                encoder.encode(frame, tile, converter, out);
+                encodedBytes += out.wireSize();
+            }
+            ++rounds;
+        }
+        const double seconds = qMax<qint64>(1, timer.nsecsElapsed()) / 1e9;
+        const double megabytes = double(frame.width()) * frame.height() * 4 * rounds / 1e6;
+        qDebug().nospace() << "[Server] encoder " << encoder.name << ": " << megabytes / seconds << " MB/s, "
+                           << encodedBytes << " bytes, ratio " << double(rawBytes) / qMax<qint64>(1, encodedBytes);
+    }
+}
+
+void benchmarkEncodeScaling(const QImage& frame) {
+    const QList<QRect> tiles = frameTiles(frame);
+    const int maxThreads = qMax(1, QThread::idealThreadCount());
+    qDebug().nospace() << "[Server] encode scaling on a " << frame.width() << "x" << frame.height()
+                       << " frame, " << tiles.size() << " tiles, up to " << maxThreads << " threads";
+
+    struct Encoder { const char* name; EncodeFunction encode; };
+    const Encoder encoders[] = {
+        { "hextile", encodeHextileRect },
+        { "zrle tiles", encodeZrleTiles },
+        { "tight tiles", encodeTightTileRect },
+    };
+
+    const PixelConverter converter;
+    QList<OutgoingRect> outgoing(tiles.size());
+    OutgoingRect* results = outgoing.data(); // detach once here, not from the workers
+    for (const Encoder& encoder : encoders) {
+        auto encodeTile = [&](int i) {
+            results[i].reset();
+            encoder.encode(frame, tiles.at(i), converter, results[i]);
+        };
+
+        double singleMs = 0.0;
+        for (int threads = 1; threads <= maxThreads; ++threads) {
+            // the calling thread joins in like a session's I/O thread does, so n threads
+            // are the caller and n - 1 workers. One thread is a plain loop
+            std::unique_ptr<TaskScheduler> scheduler;
+            if (threads > 1)
+                scheduler = std::make_unique<TaskScheduler>(threads - 1);
+
+            int rounds = 0;
+            QElapsedTimer timer;
+            timer.start();
+            while (rounds < MIN_ROUNDS || timer.nsecsElapsed() < BENCHMARK_NSECS) {
+                if (scheduler) {
+                    scheduler->parallelFor(tiles.size(), encodeTile);
+                } else {
+                    for (int i = 0; i < tiles.size(); ++i)
+                        encodeTile(i);
+                }
+                ++rounds;
+            }
+            const double frameMs = timer.nsecsElapsed() / 1e6 / rounds;
+            if (threads == 1) singleMs = frameMs;
+            qDebug().nospace() << "[Server] scaling " << encoder.name << " threads " << threads << ": "
+                               << frameMs << " ms per frame, speedup " << singleMs / frameMs
+                               << ", efficiency " << singleMs / frameMs / threads;
+        }
+    }
+}
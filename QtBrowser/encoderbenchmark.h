@@ -0,0 +1,17 @@
+#ifndef ENCODERBENCHMARK_H
+#define ENCODERBENCHMARK_H
+
+#include <QImage>
+
+// runs every encoder we have over one captured Format_RGB32 frame, tile by tile like a
+// session would but on a single thread, and logs MB/s of source pixels and how much
+// smaller than raw the result is. Run by --benchmark-encoders
+void benchmarkEncoders(const QImage& frame);
+
+// encodes the tiles of the same frame through a TaskScheduler the way a session does,
+// with 1 up to one thread per core, and logs the speedup over a single thread. Only
+// the part that runs on the workers is timed, the zlib pass stays on the session
+// thread anyway. Run by --benchmark-scaling
+void benchmarkEncodeScaling(const QImage& frame);
+
+#endif // ENCODERBENCHMARK_H
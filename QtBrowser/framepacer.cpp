@@ -0,0 +1,93 @@
+#include "framepacer.h"
+
+static const double SMOOTHING = 0.2; // weight of a new sample in the running averages
+
+static double smooth(double average, double sample) {
+    return average + SMOOTHING * (sample - average);
+}
+
+FramePacer::FramePacer()
+{
+    m_clock.start();
+    setFpsRange(DEFAULT_MIN_FPS, DEFAULT_MAX_FPS);
+    m_damageIntervalMs = m_maxIntervalMs;
+}
+
+void FramePacer::setFpsRange(double minFps, double maxFps) {
+    maxFps = qMax(1.0, maxFps);
+    minFps = qBound(0.1, minFps, maxFps);
+    m_minIntervalMs = 1000.0 / maxFps;
+    m_maxIntervalMs = 1000.0 / minFps;
+}
+
+void FramePacer::damageArrived() {
+    const qint64 now = m_clock.elapsed();
+    if (m_lastDamageMs >= 0) {
+        // long quiet stretches don't tell us anything about the rate, cap the sample
+        const double sample = qMin(double(now - m_lastDamageMs), m_maxIntervalMs);
+        m_damageIntervalMs = smooth(m_damageIntervalMs, sample);
+    }
+    m_lastDamageMs = now;
+    if (m_inputPending) {
+        m_inputPending = false;
+        m_respondNow = true;
+    }
+}
+
+void FramePacer::requestArrived() {
+    if (!m_awaitingRequest) return;
+    m_awaitingRequest = false;
+    m_rttMs = smooth(m_rttMs, double(m_clock.elapsed() - m_lastUpdateMs));
+}
+
+void FramePacer::rttMeasured(double ms) {
+    m_rttMs = smooth(m_rttMs, ms);
+}
+
+void FramePacer::updateSent(qint64 encodeNsecs) {
+    const qint64 now = m_clock.elapsed();
+    m_lastUpdateMs = now;
+    m_awaitingRequest = true;
+    m_respondNow = false;
+    m_encodeMs = smooth(m_encodeMs, encodeNsecs / 1000000.0);
+
+    advanceWindow(now);
+    ++m_updatesInWindow;
+}
+
+void FramePacer::advanceWindow(qint64 now) const {
+    const qint64 elapsed = now - m_windowStartMs;
+    if (elapsed < 1000) return;
+    // past two seconds the window should have closed a full second ago and nothing
+    // was sent since, whatever it counted is older than the last second
+    m_achievedFps = elapsed >= 2000 ? 0.0 : m_updatesInWindow * 1000.0 / double(elapsed);
+    m_windowStartMs = now;
+    m_updatesInWindow = 0;
+}
+
+double FramePacer::achievedFps() const {
+    advanceWindow(m_clock.elapsed());
+    return m_achievedFps;
+}
+
+qint64 FramePacer::targetIntervalMs() const {
+    // never faster than max FPS, never let encoding take more than half of the
+    // session threads time, and don't outrun a client that needs an RTT to answer
+    // (half an RTT, so a pipelining client still sees every other frame). A slow link
+    // or expensive encoder can only push us down to min FPS
+    double interval = qMax(m_minIntervalMs, 2.0 * m_encodeMs);
+    if (!m_continuous)
+        interval = qMax(interval, m_rttMs / 2.0);
+    return qRound64(qMin(interval, m_maxIntervalMs));
+}
+
+int FramePacer::delayBeforeNextUpdate() const {
+    if (m_lastUpdateMs < 0 || m_respondNow) return 0;
+
+    const qint64 interval = targetIntervalMs();
+    // damage that trickles in slower than we could send it gains nothing from waiting
+    if (m_damageIntervalMs >= interval) return 0;
+
+    const qint64 sinceUpdate = m_clock.elapsed() - m_lastUpdateMs;
+    return sinceUpdate >= interval ? 0 : int(interval - sinceUpdate);
+}
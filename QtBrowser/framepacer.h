@@ -0,0 +1,74 @@
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+#include <QElapsedTimer>
+#include <QtGlobal>
+
+// FramePacer decides how often one session gets an update. It watches how fast damage
+// shows up, how long the client takes to come back with its next request (our RTT
+// estimate) and what encoding costs, and turns that into a minimum spacing between
+// updates inside the configured FPS range. Sparse damage (typing, a hover effect) goes
+// out the moment it happens, continuous damage (scrolling, video) gets batched at the
+// rate the client and our encoder can actually sustain
+class FramePacer
+{
+public:
+    static constexpr double DEFAULT_MIN_FPS = 5.0;
+    static constexpr double DEFAULT_MAX_FPS = 60.0;
+
+    FramePacer();
+
+    void setFpsRange(double minFps, double maxFps);
+
+    // a snapshot with damage for this session arrived
+    void damageArrived();
+    // the client asked for more, closes the RTT measurement of the last update
+    void requestArrived();
+    // an RTT measured some other way, a fence answer in continuous mode
+    void rttMeasured(double ms);
+    // continuous updates don't wait for requests, so RTT stops limiting the rate and
+    // only the socket backlog (and the FPS range) holds updates back
+    void setContinuous(bool continuous) { m_continuous = continuous; }
+    // the client sent input. The damage that follows it goes out without pacing, that
+    // is the update the user is actually waiting for
+    void inputArrived() { m_inputPending = true; }
+    void updateSent(qint64 encodeNsecs);
+
+    // milliseconds to hold the next update back, 0 means send now
+    int delayBeforeNextUpdate() const;
+
+    // updates per second over the last full second, 0 once a whole second went by
+    // without any
+    double achievedFps() const;
+    double rttMs() const { return m_rttMs; }
+    double encodeMs() const { return m_encodeMs; }
+    double damageIntervalMs() const { return m_damageIntervalMs; }
+
+private:
+    qint64 targetIntervalMs() const;
+    // closes the FPS window once it is a second old, reading the rate does that too
+    void advanceWindow(qint64 now) const;
+
+    QElapsedTimer m_clock;
+    double m_minIntervalMs;
+    double m_maxIntervalMs;
+
+    // exponentially weighted averages
+    double m_damageIntervalMs;
+    double m_rttMs = 0.0;
+    double m_encodeMs = 0.0;
+
+    qint64 m_lastDamageMs = -1;
+    qint64 m_lastUpdateMs = -1;
+    bool m_awaitingRequest = false;
+    bool m_inputPending = false;
+    bool m_respondNow = false;
+    bool m_continuous = false;
+
+    // mutable so an idle session's rate can drop when it is read
+    mutable qint64 m_windowStartMs = 0;
+    mutable int m_updatesInWindow = 0;
+    mutable double m_achievedFps = 0.0;
+};
+
+#endif // FRAMEPACER_H
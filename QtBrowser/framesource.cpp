@@ -0,0 +1,193 @@
+#include "framesource.h"
+#include "damagetracker.h"
+#include <QDebug>
+#include <QPainter>
+#include <QThread>
+#include <QtOpenGLWidgets/QtOpenGLWidgets>
+
+static const int DEFAULT_CAPTURE_INTERVAL_MS = 16; // roughly one display refresh worth of paint events per frame
+static const int CAPTURE_SLOTS = 3; // the frame being rendered, the latest one and one a slow session still holds
+
+FrameSource::FrameSource(QWidget* view, QObject* parent)
+    : QObject(parent),
+    m_view(view),
+    m_damageTracker(new DamageTracker(view, this)),
+    m_frameSize(view ? view->size() : QSize(640, 480)),
+    m_captureIntervalMs(DEFAULT_CAPTURE_INTERVAL_MS)
+{
+    m_captureTimer.setSingleShot(true);
+    connect(&m_captureTimer, &QTimer::timeout, this, &FrameSource::capture);
+    connect(m_damageTracker, &DamageTracker::damaged, this, &FrameSource::onDamaged);
+    connect(m_damageTracker, &DamageTracker::resized, this, &FrameSource::onResized);
+}
+
+FramePtr FrameSource::latestFrame() const {
+    QMutexLocker locker(&m_frameMutex);
+    return m_latestFrame;
+}
+
+QSize FrameSource::frameSize() const {
+    QMutexLocker locker(&m_frameMutex);
+    return m_frameSize;
+}
+
+void FrameSource::setMaxFps(double maxFps) {
+    m_captureIntervalMs = qRound(1000.0 / qMax(1.0, maxFps));
+}
+
+void FrameSource::onResized(const QSize& size) {
+    QMutexLocker locker(&m_frameMutex);
+    m_frameSize = size;
+}
+
+void FrameSource::requestFrame() {
+    // sessions call this from their I/O threads, the capture itself belongs to the GUI thread
+    if (QThread::currentThread() != thread()) {
+        QMetaObject::invokeMethod(this, &FrameSource::requestFrame, Qt::QueuedConnection);
+        return;
+    }
+
+    m_frameWanted = true;
+    if (!m_latestFrame || m_damageTracker->hasDamage() || !m_glFollowUp.isEmpty())
+        scheduleCapture();
+}
+
+void FrameSource::onDamaged() {
+    // nobody is waiting, the damage just piles up in the tracker until someone asks
+    if (m_frameWanted)
+        scheduleCapture();
+}
+
+void FrameSource::scheduleCapture() {
+    if (m_captureTimer.isActive()) return;
+
+    qint64 delayMs = m_latestFrame ? m_captureIntervalMs : 0;
+    if (m_sinceCapture.isValid()) {
+        const qint64 idleNsecs = m_sinceCapture.nsecsElapsed();
+        if (idleNsecs < m_lastCaptureNsecs)
+            delayMs = qMax(delayMs, (m_lastCaptureNsecs - idleNsecs) / 1000000);
+    }
+    m_captureTimer.start(int(delayMs));
+}
+
+FrameSource::CaptureSlot& FrameSource::acquireSlot(const QSize& size, int& allocations) {
+    if (!m_slots.isEmpty() && m_slots.first().image.size() != size) {
+        // every pixel we kept describes the old size
+        m_slots.clear();
+    }
+    if (m_slots.isEmpty())
+        m_slots.resize(CAPTURE_SLOTS);
+
+    // a detached image means no snapshot (and so no session) refers to its pixels anymore
+    int index = -1;
+    for (int i = 0; i < m_slots.size() && index < 0; ++i) {
+        if (m_slots[i].image.isNull() || m_slots[i].image.isDetached())
+            index = i;
+    }
+    if (index < 0) {
+        index = m_slots.size();
+        m_slots.append(CaptureSlot());
+    }
+
+    CaptureSlot& slot = m_slots[index];
+    if (slot.image.isNull()) {
+        slot.image = QImage(size, QImage::Format_RGB32);
+        slot.stale = QRect(QPoint(0, 0), size);
+        ++allocations;
+    }
+    return slot;
+}
+
+void FrameSource::capture() {
+    if (!m_view) return;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    const QRegion viewDamage = m_damageTracker->takeDamage();
+    const QRegion damage = viewDamage | m_glFollowUp;
+    m_glFollowUp = QRegion();
+    const QRect bounds = m_view->rect();
+    if (bounds.isEmpty()) return;
+
+    // every slot falls behind by what just changed, the one we render now catches up
+    for (CaptureSlot& slot : m_slots)
+        slot.stale += damage;
+    int allocations = 0;
+    CaptureSlot& slot = acquireSlot(bounds.size(), allocations);
+    const QRegion stale = slot.stale & bounds;
+    slot.stale = QRegion();
+
+    // render() sends paint events through the tree, none of that is real damage
+    m_damageTracker->setPaused(true);
+    if (!stale.isEmpty()) {
+        // only what changed since this slot was last used gets painted, straight into
+        // its pixels (the top left of the region lands on the offset we pass)
+        m_view->render(&slot.image, stale.boundingRect().topLeft(), stale);
+
+        QOpenGLWidget* gl = m_view->findChild<QOpenGLWidget*>();
+        if (gl && gl->isVisible()) {
+            const QRect glRect(gl->mapTo(m_view, QPoint(0, 0)), gl->size());
+            if (stale.intersects(glRect)) {
+                const GlReadback::Result result = m_glReadback.readInto(gl, slot.image, glRect.topLeft(), stale);
+                if (result == GlReadback::Result::Unsupported) {
+                    // synchronous readback, the one allocation left on this path
+                    const QImage glImage = gl->grabFramebuffer();
+                    ++allocations;
+                    QPainter p(&slot.image);
+                    p.setClipRegion(stale);
+                    p.drawImage(glRect.topLeft(), glImage);
+                } else if (result != GlReadback::Result::Copied || viewDamage.intersects(glRect)) {
+                    // what we copied (if anything) is older than what the child shows
+                    // now, the read we just queued gets picked up next capture. A copy
+                    // of a read that was already superseded repeats until it is current.
+                    // Once the child stops changing this settles after one more capture
+                    m_glFollowUp = glRect;
+                }
+            }
+        }
+    }
+    m_damageTracker->setPaused(false);
+
+    const QImage& image = slot.image;
+
+    // only tiles whose pixels actually differ from the last snapshot count as damage,
+    // the rest was a repaint that produced the same pixels
+    const QRegion changed = m_tileHasher.changedTiles(image, damage);
+
+    m_lastCaptureNsecs = timer.nsecsElapsed();
+    m_maxCaptureNsecs = qMax(m_maxCaptureNsecs, m_lastCaptureNsecs);
+    m_lastCaptureAllocations = allocations;
+    m_captureAllocations += allocations;
+    ++m_framesCaptured;
+    m_sinceCapture.start();
+
+    if (m_framesCaptured % 100 == 0) {
+        qDebug() << "[Server] captured" << m_framesCaptured << "frames, worst stall ms:"
+                 << m_maxCaptureNsecs / 1000000.0 << "tile hash ns/MPix:"
+                 << qRound64(m_tileHasher.nsecsPerMegapixel())
+                 << "last stall ms:" << m_lastCaptureNsecs / 1000000.0
+                 << "framebuffer allocations:" << m_captureAllocations << "ring:" << m_slots.size();
+    }
+
+    // consumers are still waiting for something that actually changed
+    if (m_latestFrame && changed.isEmpty()) {
+        // the GL child may still have it in flight
+        if (!m_glFollowUp.isEmpty())
+            scheduleCapture();
+        return;
+    }
+
+    QSharedPointer<FrameSnapshot> frame(new FrameSnapshot);
+    frame->image = image;
+    frame->damage = changed;
+    frame->serial = m_latestFrame ? m_latestFrame->serial + 1 : 1;
+    frame->captureNsecs = m_lastCaptureNsecs;
+    {
+        QMutexLocker locker(&m_frameMutex);
+        m_latestFrame = frame;
+    }
+    m_frameWanted = false;
+
+    emit frameReady(frame);
+}
@@ -0,0 +1,124 @@
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QPointer>
+#include <QImage>
+#include <QRegion>
+#include <QSharedPointer>
+#include <QTimer>
+#include <QWidget>
+#include "tilehasher.h"
+#include "glreadback.h"
+
+class DamageTracker;
+
+// one captured frame. Snapshots are shared read only by every session across the I/O
+// threads, nothing may touch them after frameReady() has gone out
+struct FrameSnapshot
+{
+    // exactly what the widget rendered, always Format_RGB32. This is also the pixel
+    // format we advertise, so the GUI thread and the sessions do no conversion at all
+    QImage image;
+    // tiles whose pixels differ from the previous snapshot
+    QRegion damage;
+    quint64 serial = 0;
+    // GUI thread stall this capture cost, including the tile hash pass
+    qint64 captureNsecs = 0;
+};
+
+using FramePtr = QSharedPointer<const FrameSnapshot>;
+
+// FrameSource turns capturing the widget tree into an asynchronous stage: consumers ask
+// for a frame with requestFrame() and get frameReady() with a snapshot once the GUI
+// thread gets around to it. The capture always runs from the event loop, never nested
+// inside a socket or timer slot, and never pumps the event loop itself.
+// The server owns exactly one of these, so the view is captured once per frame no
+// matter how many viewers are attached
+class FrameSource : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FrameSource(QWidget* view, QObject* parent = nullptr);
+
+    // a consumer wants the next frame that has changes in it. Nothing is captured until
+    // the view actually repaints (or there is no frame at all yet). Several requests
+    // before the capture runs collapse into one frame, and captures are spaced by at
+    // least the time the previous one took, so capturing can never eat more than half
+    // of the GUI thread no matter how many frames are asked for
+    // safe to call from any thread
+    void requestFrame();
+
+    // no session can pace faster than this, so there is no point capturing faster.
+    // GUI thread only
+    void setMaxFps(double maxFps);
+
+    // both safe to call from any thread
+    FramePtr latestFrame() const;
+    QSize frameSize() const;
+
+    // GUI thread stall per capture, so we can see what a frame really costs the browser.
+    // GUI thread only, sessions get the per frame number from the snapshot
+    qint64 lastCaptureNsecs() const { return m_lastCaptureNsecs; }
+    qint64 maxCaptureNsecs() const { return m_maxCaptureNsecs; }
+    quint64 framesCaptured() const { return m_framesCaptured; }
+    // framebuffers allocated by capturing, last frame and running total. Stays at zero
+    // while the ring keeps up and the size doesn't change
+    int lastCaptureAllocations() const { return m_lastCaptureAllocations; }
+    quint64 captureAllocations() const { return m_captureAllocations; }
+    const TileHasher& tileHasher() const { return m_tileHasher; }
+
+signals:
+    void frameReady(const FramePtr& frame);
+
+private slots:
+    void onDamaged();
+    void onResized(const QSize& size);
+    void capture();
+
+private:
+    // a preallocated framebuffer the view renders into. Snapshots share its pixels, so a
+    // slot is only reused once every snapshot taken from it has been dropped. stale is
+    // what changed on screen since this slot was last rendered
+    struct CaptureSlot
+    {
+        QImage image;
+        QRegion stale;
+    };
+
+    void scheduleCapture();
+    // a slot no snapshot is using anymore, sized for the view. Grows the ring (and
+    // counts the allocation) only when every slot is still held by some session
+    CaptureSlot& acquireSlot(const QSize& size, int& allocations);
+
+    QPointer<QWidget> m_view;
+    DamageTracker* m_damageTracker;
+    // hashes of the latest snapshot, filters out repaints that changed nothing
+    TileHasher m_tileHasher;
+    QList<CaptureSlot> m_slots;
+    // GL content arrives one capture late, this is the GL child area that still needs
+    // another capture to catch up (a read was still in flight or the child just changed)
+    GlReadback m_glReadback;
+    QRegion m_glFollowUp;
+    // guards m_latestFrame and m_frameSize, the sessions read them from their own threads
+    mutable QMutex m_frameMutex;
+    FramePtr m_latestFrame;
+    QSize m_frameSize;
+    bool m_frameWanted = false;
+
+    QTimer m_captureTimer;
+    // paint events arriving within this window of the last capture share the next one
+    int m_captureIntervalMs;
+    QElapsedTimer m_sinceCapture;
+
+    qint64 m_lastCaptureNsecs = 0;
+    qint64 m_maxCaptureNsecs = 0;
+    quint64 m_framesCaptured = 0;
+    int m_lastCaptureAllocations = 0;
+    quint64 m_captureAllocations = 0;
+};
+
+#endif // FRAMESOURCE_H
@@ -0,0 +1,150 @@
+#include "glreadback.h"
+#include <QDebug>
+#include <QOpenGLContext>
+#include <cstring>
+
+#ifndef GL_BGRA
+#define GL_BGRA 0x80E1
+#endif
+
+GlReadback::~GlReadback() {
+    release();
+}
+
+void GlReadback::release() {
+    if (m_widget && m_gl) {
+        m_widget->makeCurrent();
+        for (Buffer& buffer : m_buffers) {
+            if (buffer.fence) m_gl->glDeleteSync(buffer.fence);
+            if (buffer.id) m_gl->glDeleteBuffers(1, &buffer.id);
+        }
+        m_widget->doneCurrent();
+    }
+    // a widget that is already gone took its context and every buffer with it
+    for (Buffer& buffer : m_buffers)
+        buffer = Buffer();
+    m_widget = nullptr;
+    m_gl = nullptr;
+    m_size = QSize();
+    m_ready = -1;
+}
+
+bool GlReadback::setUp(QOpenGLWidget* gl) {
+    const QSize size = gl->size();
+    if (gl == m_widget && size == m_size) return true;
+    release();
+
+    QOpenGLContext* context = gl->context();
+    if (!context) return false;
+
+    // pack buffers and fences are core in desktop GL 3.2, Mesa's llvmpipe has both.
+    // ES would need GL_RGBA plus a swizzle and hidpi or multisampled framebuffers need
+    // scaling or a resolve, grabFramebuffer() already does all of that
+    const bool core32 = context->format().version() >= qMakePair(3, 2);
+    const bool extensions = context->hasExtension("GL_ARB_sync") && context->hasExtension("GL_ARB_pixel_buffer_object");
+    if (context->isOpenGLES() || !(core32 || extensions)
+        || gl->devicePixelRatioF() != 1.0 || gl->format().samples() > 0) {
+        qDebug() << "[Server] async GL readback unavailable, falling back to grabFramebuffer()";
+        m_supported = false;
+        return false;
+    }
+
+    m_widget = gl;
+    m_gl = context->extraFunctions();
+    m_size = size;
+    gl->makeCurrent();
+    const GLsizeiptr bytes = GLsizeiptr(size.width()) * size.height() * 4;
+    for (Buffer& buffer : m_buffers) {
+        m_gl->glGenBuffers(1, &buffer.id);
+        m_gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.id);
+        m_gl->glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+    }
+    m_gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    gl->doneCurrent();
+    return true;
+}
+
+void GlReadback::collectFinished() {
+    // the newest read whose fence has signaled wins, older finished ones are superseded.
+    // A zero timeout only polls, this never blocks
+    int newest = m_ready;
+    for (int i = 0; i < RING_SIZE; ++i) {
+        Buffer& buffer = m_buffers[i];
+        if (!buffer.fence) continue;
+        const GLenum status = m_gl->glClientWaitSync(buffer.fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) continue;
+
+        m_gl->glDeleteSync(buffer.fence);
+        buffer.fence = nullptr;
+        if (newest < 0 || buffer.sequence > m_buffers[newest].sequence)
+            newest = i;
+    }
+    m_ready = newest;
+}
+
+void GlReadback::queueRead() {
+    // any buffer that is neither in flight nor holding the pixels we hand out
+    int index = -1;
+    for (int i = 0; i < RING_SIZE && index < 0; ++i) {
+        if (!m_buffers[i].fence && i != m_ready)
+            index = i;
+    }
+    // every buffer busy means the pipeline is behind anyway, skip this frame
+    if (index < 0) return;
+
+    Buffer& buffer = m_buffers[index];
+    m_gl->glBindFramebuffer(GL_FRAMEBUFFER, m_widget->defaultFramebufferObject());
+    m_gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.id);
+    m_gl->glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    // with a pack buffer bound the pointer is an offset and the call returns right away
+    m_gl->glReadPixels(0, 0, m_size.width(), m_size.height(), GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+    m_gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    buffer.fence = m_gl->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    buffer.sequence = m_nextSequence++;
+    // make sure the read actually gets submitted before we come back to poll
+    m_gl->glFlush();
+}
+
+void GlReadback::copyOut(const Buffer& buffer, QImage& target, const QPoint& offset, const QRegion& clip) {
+    const QRegion area = clip & QRect(offset, m_size) & target.rect();
+    if (area.isEmpty()) return;
+
+    const GLsizeiptr bytes = GLsizeiptr(m_size.width()) * m_size.height() * 4;
+    m_gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.id);
+    const uchar* pixels = static_cast<const uchar*>(m_gl->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT));
+    if (pixels) {
+        const int stride = m_size.width() * 4;
+        for (const QRect& rect : area) {
+            for (int y = rect.top(); y <= rect.bottom(); ++y) {
+                // GL rows start at the bottom
+                const int glRow = m_size.height() - 1 - (y - offset.y());
+                std::memcpy(target.scanLine(y) + rect.x() * 4,
+                            pixels + glRow * stride + (rect.x() - offset.x()) * 4,
+                            rect.width() * 4);
+            }
+        }
+        m_gl->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    m_gl->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+GlReadback::Result GlReadback::readInto(QOpenGLWidget* gl, QImage& target, const QPoint& offset, const QRegion& clip) {
+    Q_ASSERT(target.depth() == 32);
+    if (!m_supported || !gl || !gl->isValid()) return Result::Unsupported;
+
+    if (!setUp(gl)) return Result::Unsupported;
+
+    gl->makeCurrent();
+    // the newest read an earlier capture queued, what we copy should be at least that one
+    const quint64 newestQueued = m_nextSequence - 1;
+    collectFinished();
+    queueRead();
+
+    Result result = Result::Pending;
+    if (m_ready >= 0) {
+        copyOut(m_buffers[m_ready], target, offset, clip);
+        result = m_buffers[m_ready].sequence < newestQueued ? Result::CopiedStale : Result::Copied;
+    }
+    gl->doneCurrent();
+    return result;
+}
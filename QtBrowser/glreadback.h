@@ -0,0 +1,61 @@
+#ifndef GLREADBACK_H
+#define GLREADBACK_H
+
+#include <QImage>
+#include <QOpenGLExtraFunctions>
+#include <QPointer>
+#include <QRegion>
+#include <QtOpenGLWidgets/QOpenGLWidget>
+
+// GlReadback reads a QOpenGLWidget's framebuffer through a small ring of pixel buffer
+// objects instead of grabFramebuffer(), which stalls until the GPU (or llvmpipe) has
+// finished everything queued. Every call queues a read of the current frame and copies
+// out the newest read that has already finished, so frame N is read back while N+1
+// renders and the capture never waits on the GL pipeline. The price is that the pixels
+// we hand out are one capture behind the widget
+class GlReadback
+{
+public:
+    enum class Result {
+        Copied,      // an earlier read was copied into the target
+        CopiedStale, // copied, but a newer read from before this call is still in flight
+        Pending,     // reads are queued but none finished yet, the target was not touched
+        Unsupported  // no fences or PBOs on this context, use grabFramebuffer()
+    };
+
+    GlReadback() = default;
+    ~GlReadback();
+
+    // queues a read of gl's framebuffer and copies the newest finished one into target,
+    // with the widget's top left at offset and only inside clip. target must be 32 bits
+    // per pixel and not shared
+    Result readInto(QOpenGLWidget* gl, QImage& target, const QPoint& offset, const QRegion& clip);
+
+    // frees the buffers, needs the widget to still be around
+    void release();
+
+private:
+    struct Buffer
+    {
+        GLuint id = 0;
+        GLsync fence = nullptr; // set while the read is in flight
+        quint64 sequence = 0;
+    };
+
+    static const int RING_SIZE = 3; // one finished, one in flight, one being queued
+
+    bool setUp(QOpenGLWidget* gl);
+    void collectFinished();
+    void queueRead();
+    void copyOut(const Buffer& buffer, QImage& target, const QPoint& offset, const QRegion& clip);
+
+    QPointer<QOpenGLWidget> m_widget;
+    QOpenGLExtraFunctions* m_gl = nullptr;
+    QSize m_size;
+    bool m_supported = true;
+    Buffer m_buffers[RING_SIZE];
+    int m_ready = -1; // newest finished read
+    quint64 m_nextSequence = 1;
+};
+
+#endif // GLREADBACK_H
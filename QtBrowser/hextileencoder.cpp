@@ -0,0 +1,223 @@
+#include "hextileencoder.h"
+#include <QtAlgorithms>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEXTILE_SSE2
+#include <emmintrin.h>
+#endif
+
+static const int SUBTILE_SIZE = 16;
+static const int MAX_SUBRECTS = 255; // the count is a single byte
+
+// subencoding flags
+static const uchar HEXTILE_RAW = 0x01;
+static const uchar HEXTILE_BACKGROUND_SPECIFIED = 0x02;
+static const uchar HEXTILE_FOREGROUND_SPECIFIED = 0x04;
+static const uchar HEXTILE_ANY_SUBRECTS = 0x08;
+
+// what a subtile holds. Three means three or more, those go raw. With two colours the
+// background is the more common one, so the foreground needs fewer rectangles
+struct SubtileColours
+{
+    int count = 1;
+    quint32 background = 0;
+    quint32 foreground = 0;
+};
+
+// pixels are stride words apart from row to row
+static SubtileColours classify(const quint32* pixels, qsizetype stride, int width, int height) {
+    SubtileColours colours;
+    const quint32 first = pixels[0];
+    colours.background = first;
+
+    // first pass: the first pixel that differs, most subtiles end here as solid
+    bool found = false;
+    quint32 other = 0;
+    for (int y = 0; y < height && !found; ++y) {
+        const quint32* row = pixels + y * stride;
+        int x = 0;
+#ifdef HEXTILE_SSE2
+        const __m128i a = _mm_set1_epi32(int(first));
+        for (; x + 4 <= width; x += 4) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+            const int equal = _mm_movemask_epi8(_mm_cmpeq_epi32(v, a));
+            if (equal != 0xffff) {
+                // four mask bits per pixel, the lowest clear one is the first mismatch
+                other = row[x + qCountTrailingZeroBits(quint32(~equal)) / 4];
+                found = true;
+                break;
+            }
+        }
+#endif
+        for (; x < width && !found; ++x) {
+            if (row[x] != first) {
+                other = row[x];
+                found = true;
+            }
+        }
+    }
+    if (!found) return colours;
+
+    // second pass: every pixel is one of the two, counting the first colour on the way
+    int firstCount = 0;
+    for (int y = 0; y < height; ++y) {
+        const quint32* row = pixels + y * stride;
+        int x = 0;
+#ifdef HEXTILE_SSE2
+        const __m128i a = _mm_set1_epi32(int(first));
+        const __m128i b = _mm_set1_epi32(int(other));
+        for (; x + 4 <= width; x += 4) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+            const __m128i isA = _mm_cmpeq_epi32(v, a);
+            const __m128i either = _mm_or_si128(isA, _mm_cmpeq_epi32(v, b));
+            if (_mm_movemask_epi8(either) != 0xffff) {
+                colours.count = 3;
+                return colours;
+            }
+            firstCount += qPopulationCount(quint32(_mm_movemask_epi8(isA))) / 4;
+        }
+#endif
+        for (; x < width; ++x) {
+            if (row[x] == first) ++firstCount;
+            else if (row[x] != other) {
+                colours.count = 3;
+                return colours;
+            }
+        }
+    }
+
+    colours.count = 2;
+    const bool firstIsBackground = firstCount * 2 >= width * height;
+    colours.background = firstIsBackground ? first : other;
+    colours.foreground = firstIsBackground ? other : first;
+    return colours;
+}
+
+// covers every foreground pixel with rectangles, greedily: a run to the right, then
+// grown downwards while the rows below match. Writes 2 bytes per rectangle, returns
+// how many or -1 once there would be more than MAX_SUBRECTS
+static int findSubrects(const quint32* pixels, qsizetype stride, int width, int height, quint32 foreground,
+                        uchar* out) {
+    quint16 covered[SUBTILE_SIZE] = {};
+    int count = 0;
+    for (int y = 0; y < height; ++y) {
+        const quint32* row = pixels + y * stride;
+        for (int x = 0; x < width; ++x) {
+            if (row[x] != foreground || (covered[y] & (1 << x))) continue;
+
+            int right = x;
+            while (right + 1 < width && row[right + 1] == foreground && !(covered[y] & (1 << (right + 1))))
+                ++right;
+            const quint16 span = quint16(((1 << (right + 1)) - 1) & ~((1 << x) - 1));
+
+            int bottom = y;
+            while (bottom + 1 < height) {
+                const quint32* below = pixels + (bottom + 1) * stride;
+                if (covered[bottom + 1] & span) break;
+                int i = x;
+                while (i <= right && below[i] == foreground)
+                    ++i;
+                if (i <= right) break;
+                ++bottom;
+            }
+            for (int i = y; i <= bottom; ++i)
+                covered[i] |= span;
+
+            if (count == MAX_SUBRECTS) return -1;
+            out[count * 2] = uchar((x << 4) | y);
+            out[count * 2 + 1] = uchar(((right - x) << 4) | (bottom - y));
+            ++count;
+            x = right;
+        }
+    }
+    return count;
+}
+
+static int putPixel(const PixelConverter& converter, quint32 pixel, uchar* dst) {
+    if (converter.isIdentity())
+        std::memcpy(dst, &pixel, 4);
+    else
+        converter.convert(&pixel, dst, 1);
+    return converter.format().bytesPerPixel();
+}
+
+void encodeHextileRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                       OutgoingRect& out) {
+    out.appendRectHeader(rect, ENCODING_HEXTILE);
+
+    const int bytesPerPixel = converter.format().bytesPerPixel();
+    const qsizetype stride = image.bytesPerLine() / 4;
+    // background and foreground carry over from subtile to subtile until a raw one
+    bool haveBackground = false;
+    bool haveForeground = false;
+    quint32 background = 0;
+    quint32 foreground = 0;
+    // the largest non raw subtile: flags, two pixels, a count and every subrect
+    uchar scratch[1 + 2 * 4 + 1 + 2 * MAX_SUBRECTS];
+
+    for (int ty = rect.top(); ty <= rect.bottom(); ty += SUBTILE_SIZE) {
+        const int height = qMin(SUBTILE_SIZE, rect.bottom() - ty + 1);
+        for (int tx = rect.left(); tx <= rect.right(); tx += SUBTILE_SIZE) {
+            const int width = qMin(SUBTILE_SIZE, rect.right() - tx + 1);
+            const quint32* pixels = reinterpret_cast<const quint32*>(image.constScanLine(ty)) + tx;
+            const SubtileColours colours = classify(pixels, stride, width, height);
+
+            if (colours.count == 1) {
+                int size = 1;
+                scratch[0] = 0;
+                if (!haveBackground || background != colours.background) {
+                    scratch[0] = HEXTILE_BACKGROUND_SPECIFIED;
+                    size += putPixel(converter, colours.background, scratch + 1);
+                    background = colours.background;
+                    haveBackground = true;
+                }
+                out.append(reinterpret_cast<const char*>(scratch), size);
+                continue;
+            }
+
+            if (colours.count == 2) {
+                uchar flags = HEXTILE_ANY_SUBRECTS;
+                int size = 1;
+                const bool newBackground = !haveBackground || background != colours.background;
+                const bool newForeground = !haveForeground || foreground != colours.foreground;
+                if (newBackground) {
+                    flags |= HEXTILE_BACKGROUND_SPECIFIED;
+                    size += putPixel(converter, colours.background, scratch + size);
+                }
+                if (newForeground) {
+                    flags |= HEXTILE_FOREGROUND_SPECIFIED;
+                    size += putPixel(converter, colours.foreground, scratch + size);
+                }
+                const int subrects = findSubrects(pixels, stride, width, height, colours.foreground,
+                                                  scratch + size + 1);
+                // a noisy subtile can take more rectangles than raw takes bytes
+                if (subrects >= 0 && size + 1 + subrects * 2 < 1 + width * height * bytesPerPixel) {
+                    scratch[0] = flags;
+                    scratch[size] = uchar(subrects);
+                    size += 1 + subrects * 2;
+                    out.append(reinterpret_cast<const char*>(scratch), size);
+                    background = colours.background;
+                    foreground = colours.foreground;
+                    haveBackground = haveForeground = true;
+                    continue;
+                }
+            }
+
+            // raw, and the colours after it have to be specified again
+            const char raw = char(HEXTILE_RAW);
+            out.append(&raw, 1);
+            const int rowBytes = width * bytesPerPixel;
+            uchar* dst = reinterpret_cast<uchar*>(out.grow(qsizetype(rowBytes) * height));
+            for (int y = 0; y < height; ++y, dst += rowBytes) {
+                const quint32* row = pixels + y * stride;
+                if (converter.isIdentity())
+                    std::memcpy(dst, row, rowBytes);
+                else
+                    converter.convert(row, dst, width);
+            }
+            out.bytesCopied += qsizetype(rowBytes) * height;
+            haveBackground = haveForeground = false;
+        }
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef HEXTILEENCODER_H
+#define HEXTILEENCODER_H
+
+#include <QImage>
+#include <QRect>
+#include "pixelformat.h"
+#include "rfboutput.h"
+
+static const qint32 ENCODING_HEXTILE = 5;
+
+// Hextile (encoding 5) for one rectangle of a Format_RGB32 frame. The rectangle is cut
+// into 16x16 subtiles and each one is classified with a vector scan: a solid subtile
+// costs one byte (or one pixel when the background changes), a two colour one, which is
+// most of a page's text and UI, becomes a list of 2 byte foreground rectangles, and
+// anything busier goes raw. Thread safe, the workers call it for their tiles at once
+void encodeHextileRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                       OutgoingRect& out);
+
+#endif // HEXTILEENCODER_H
@@ -0,0 +1,269 @@
+#include "inputinjector.h"
+#include <QCoreApplication>
+#include <QKeyEvent>
+#include <QMouseEvent>
+#include <QMutexLocker>
+#include <QWheelEvent>
+
+static const QEvent::Type FLUSH_EVENT = QEvent::Type(QEvent::User + 1);
+static const int WHEEL_STEP = 120; // one notch, what a real mouse wheel reports
+
+// RFB buttons are bits of the mask, 1 left 2 middle 3 right, 4/5 wheel up/down and
+// 6/7 wheel left/right
+static const Qt::MouseButton MASK_BUTTONS[3] = { Qt::LeftButton, Qt::MiddleButton, Qt::RightButton };
+
+static Qt::MouseButtons buttonsFromMask(quint8 mask) {
+    Qt::MouseButtons buttons;
+    for (int i = 0; i < 3; ++i) {
+        if (mask & (1 << i)) buttons |= MASK_BUTTONS[i];
+    }
+    return buttons;
+}
+
+// X11 keysyms (what RFB sends) to Qt keys. Latin-1 maps straight onto Qt's key codes,
+// unicode keysyms carry the code point, the rest comes from this table
+struct KeysymEntry
+{
+    quint32 keysym;
+    int key;
+};
+
+static const KeysymEntry KEYSYMS[] = {
+    { 0xff08, Qt::Key_Backspace }, { 0xff09, Qt::Key_Tab }, { 0xfe20, Qt::Key_Backtab },
+    { 0xff0d, Qt::Key_Return }, { 0xff8d, Qt::Key_Enter }, { 0xff1b, Qt::Key_Escape },
+    { 0xff63, Qt::Key_Insert }, { 0xffff, Qt::Key_Delete }, { 0xff9f, Qt::Key_Delete },
+    { 0xff50, Qt::Key_Home }, { 0xff57, Qt::Key_End }, { 0xff55, Qt::Key_PageUp }, { 0xff56, Qt::Key_PageDown },
+    { 0xff51, Qt::Key_Left }, { 0xff52, Qt::Key_Up }, { 0xff53, Qt::Key_Right }, { 0xff54, Qt::Key_Down },
+    { 0xffe1, Qt::Key_Shift }, { 0xffe2, Qt::Key_Shift }, { 0xffe3, Qt::Key_Control }, { 0xffe4, Qt::Key_Control },
+    { 0xffe7, Qt::Key_Meta }, { 0xffe8, Qt::Key_Meta }, { 0xffe9, Qt::Key_Alt }, { 0xffea, Qt::Key_Alt },
+    { 0xffeb, Qt::Key_Meta }, { 0xffec, Qt::Key_Meta }, { 0xfe03, Qt::Key_AltGr },
+    { 0xffe5, Qt::Key_CapsLock }, { 0xff7f, Qt::Key_NumLock }, { 0xff14, Qt::Key_ScrollLock },
+    { 0xff13, Qt::Key_Pause }, { 0xff61, Qt::Key_Print }, { 0xff67, Qt::Key_Menu },
+};
+
+static int keyFromKeysym(quint32 keysym, QString& text) {
+    if (keysym >= 0x20 && keysym <= 0xff) {
+        text = QChar(char16_t(keysym));
+        // Qt uses the upper case code for letter keys, the text keeps the real case
+        return QChar(char16_t(keysym)).toUpper().unicode();
+    }
+    if ((keysym & 0xff000000) == 0x01000000) {
+        const char32_t codePoint = keysym & 0x00ffffff;
+        text = QString::fromUcs4(&codePoint, 1);
+        return text.isEmpty() ? Qt::Key_unknown : int(text.at(0).toUpper().unicode());
+    }
+    if (keysym >= 0xffbe && keysym <= 0xffd5) // F1 to F24
+        return Qt::Key_F1 + int(keysym - 0xffbe);
+    if (keysym >= 0xffb0 && keysym <= 0xffb9) { // keypad digits
+        text = QChar(char16_t('0' + (keysym - 0xffb0)));
+        return Qt::Key_0 + int(keysym - 0xffb0);
+    }
+
+    for (const KeysymEntry& entry : KEYSYMS) {
+        if (entry.keysym == keysym) {
+            if (entry.key == Qt::Key_Return || entry.key == Qt::Key_Enter) text = QStringLiteral("\r");
+            else if (entry.key == Qt::Key_Tab) text = QStringLiteral("\t");
+            else if (entry.key == Qt::Key_Backspace) text = QStringLiteral("\b");
+            else if (entry.key == Qt::Key_Escape) text = QStringLiteral("\x1b");
+            return entry.key;
+        }
+    }
+    return Qt::Key_unknown;
+}
+
+static Qt::KeyboardModifier modifierForKey(int key) {
+    switch (key) {
+    case Qt::Key_Shift: return Qt::ShiftModifier;
+    case Qt::Key_Control: return Qt::ControlModifier;
+    case Qt::Key_Alt: return Qt::AltModifier;
+    case Qt::Key_Meta: return Qt::MetaModifier;
+    default: return Qt::NoModifier;
+    }
+}
+
+InputInjector::InputInjector(QWidget* root, QObject* parent)
+    : QObject(parent),
+    m_root(root)
+{
+}
+
+void InputInjector::postPointer(const void* source, quint8 buttonMask, const QPoint& position) {
+    Input input;
+    input.source = source;
+    input.buttonMask = buttonMask;
+    input.position = position;
+    post(input);
+}
+
+void InputInjector::postSourceGone(const void* source) {
+    Input input;
+    input.source = source;
+    input.sourceGone = true;
+    post(input);
+}
+
+void InputInjector::postKey(bool down, quint32 keysym) {
+    Input input;
+    input.pointer = false;
+    input.down = down;
+    input.keysym = keysym;
+    post(input);
+}
+
+quint64 InputInjector::postSync() {
+    Input input;
+    input.pointer = false;
+    {
+        QMutexLocker locker(&m_queueMutex);
+        input.syncToken = ++m_nextSyncToken;
+    }
+    post(input);
+    return input.syncToken;
+}
+
+void InputInjector::post(const Input& input) {
+    QMutexLocker locker(&m_queueMutex);
+    Input queued = input;
+    if (input.sourceGone) {
+        m_queuedButtonMasks.remove(input.source);
+    } else if (input.pointer) {
+        // same buttons as this client's pointer event before means nothing but a move
+        queued.moveOnly = input.buttonMask == m_queuedButtonMasks.value(input.source);
+        m_queuedButtonMasks.insert(input.source, input.buttonMask);
+
+        // a move right behind another move of the same client only needs the newest
+        // position. Presses and releases always keep their own entry, and where they
+        // happened
+        if (queued.moveOnly && !m_queue.isEmpty()) {
+            Input& last = m_queue.last();
+            if (last.pointer && last.moveOnly && last.source == input.source) {
+                last.position = input.position;
+                ++m_coalesced;
+                return;
+            }
+        }
+    }
+    m_queue.append(queued);
+
+    if (!m_flushPosted) {
+        m_flushPosted = true;
+        // high priority events are handled before everything already posted, that
+        // includes the queued frame requests and the capture timer
+        QCoreApplication::postEvent(this, new QEvent(FLUSH_EVENT), Qt::HighEventPriority);
+    }
+}
+
+void InputInjector::customEvent(QEvent* event) {
+    if (event->type() != FLUSH_EVENT) return;
+
+    QList<Input> inputs;
+    {
+        QMutexLocker locker(&m_queueMutex);
+        inputs.swap(m_queue);
+        m_flushPosted = false;
+    }
+    if (!m_root) return;
+
+    for (const Input& input : std::as_const(inputs)) {
+        if (input.syncToken) {
+            emit synced(input.syncToken);
+            continue;
+        }
+        if (input.sourceGone) {
+            // let go of its buttons where the pointer is now, then forget it
+            Input release = input;
+            release.position = m_lastPosition;
+            release.buttonMask = 0;
+            deliverPointer(release);
+            m_sourceButtonMasks.remove(input.source);
+            continue;
+        }
+        if (input.pointer)
+            deliverPointer(input);
+        else
+            deliverKey(input);
+        ++m_delivered;
+    }
+}
+
+QWidget* InputInjector::widgetAt(const QPoint& position) const {
+    if (m_grabWidget) return m_grabWidget;
+    QWidget* child = m_root->childAt(position);
+    return child ? child : m_root.data();
+}
+
+void InputInjector::deliverPointer(const Input& input) {
+    const QPoint position = input.position;
+    const QPointF global = m_root->mapToGlobal(QPointF(position));
+    const quint8 previous = m_buttonMask;
+    const quint8 sourcePrevious = m_sourceButtonMasks.value(input.source);
+    m_sourceButtonMasks.insert(input.source, input.buttonMask);
+
+    // a button is down while any client holds it, so one client moving with nothing
+    // pressed doesn't release another one's drag
+    quint8 merged = 0;
+    for (quint8 mask : std::as_const(m_sourceButtonMasks))
+        merged |= mask & 0x07;
+
+    if (position != m_lastPosition) {
+        QWidget* target = widgetAt(position);
+        QMouseEvent move(QEvent::MouseMove, target->mapFrom(m_root, QPointF(position)), global,
+                         Qt::NoButton, buttonsFromMask(previous), m_modifiers);
+        QCoreApplication::sendEvent(target, &move);
+        m_lastPosition = position;
+        emit pointerMoved(position);
+    }
+
+    // presses and releases, one event per button that changed
+    for (int i = 0; i < 3; ++i) {
+        const quint8 bit = 1 << i;
+        if ((previous & bit) == (merged & bit)) continue;
+
+        const bool press = merged & bit;
+        QWidget* target = widgetAt(position);
+        if (press && !m_grabWidget) {
+            m_grabWidget = target;
+            target->setFocus(Qt::MouseFocusReason);
+        }
+        m_buttonMask = (m_buttonMask & ~bit) | (merged & bit);
+        QMouseEvent event(press ? QEvent::MouseButtonPress : QEvent::MouseButtonRelease,
+                          target->mapFrom(m_root, QPointF(position)), global,
+                          MASK_BUTTONS[i], buttonsFromMask(m_buttonMask), m_modifiers);
+        QCoreApplication::sendEvent(target, &event);
+        if (!(m_buttonMask & 0x07)) m_grabWidget = nullptr;
+    }
+
+    // wheel "buttons" come as a press and a release, the press is the notch
+    for (int i = 3; i < 7; ++i) {
+        const quint8 bit = 1 << i;
+        if (!(input.buttonMask & bit) || (sourcePrevious & bit)) continue;
+
+        const int step = (i == 3 || i == 5) ? WHEEL_STEP : -WHEEL_STEP;
+        const QPoint angle = i < 5 ? QPoint(0, step) : QPoint(step, 0);
+        QWidget* target = widgetAt(position);
+        QWheelEvent wheel(target->mapFrom(m_root, QPointF(position)), global, QPoint(), angle,
+                          buttonsFromMask(m_buttonMask), m_modifiers, Qt::NoScrollPhase, false);
+        QCoreApplication::sendEvent(target, &wheel);
+    }
+}
+
+void InputInjector::deliverKey(const Input& input) {
+    QString text;
+    const int key = keyFromKeysym(input.keysym, text);
+    if (key == Qt::Key_unknown) return;
+
+    const Qt::KeyboardModifier modifier = modifierForKey(key);
+    if (modifier != Qt::NoModifier)
+        m_modifiers.setFlag(modifier, input.down);
+    // control sequences have no text, that is how Qt tells ctrl+c from typing a c
+    if (m_modifiers & (Qt::ControlModifier | Qt::MetaModifier))
+        text.clear();
+
+    // keys go where the focus is inside the captured tree, the web view's focus proxy
+    // once something in the page was clicked
+    QWidget* target = m_root->focusWidget();
+    if (!target) target = m_root->focusProxy() ? m_root->focusProxy() : m_root.data();
+
+    QKeyEvent event(input.down ? QEvent::KeyPress : QEvent::KeyRelease, key, m_modifiers, text);
+    QCoreApplication::sendEvent(target, &event);
+}
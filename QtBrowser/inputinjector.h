@@ -0,0 +1,87 @@
+#ifndef INPUTINJECTOR_H
+#define INPUTINJECTOR_H
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QPoint>
+#include <QPointer>
+#include <QWidget>
+
+// InputInjector turns RFB KeyEvents and PointerEvents into Qt events for the captured
+// widget tree. Sessions post from their I/O threads, delivery happens on the GUI
+// thread through a high priority posted event, so input always runs before a capture
+// or anything else already waiting in the event loop. Pointer moves that pile up in
+// between are collapsed into the latest position, button changes are never dropped.
+// Every client has its own buttons, the widgets see them merged into one pointer
+class InputInjector : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit InputInjector(QWidget* root, QObject* parent = nullptr);
+
+    // both safe to call from any thread. position is in framebuffer coordinates,
+    // source is whatever tells the clients apart (the session)
+    void postPointer(const void* source, quint8 buttonMask, const QPoint& position);
+    void postKey(bool down, quint32 keysym);
+    // the client behind source is gone, releases whatever buttons it still held.
+    // Safe to call from any thread, nothing may be posted for source after it
+    void postSourceGone(const void* source);
+    // queues a marker behind everything posted so far and returns its token. synced()
+    // reports it once every input before it was delivered. Safe to call from any thread
+    quint64 postSync();
+
+    // GUI thread only
+    quint64 eventsDelivered() const { return m_delivered; }
+    quint64 movesCoalesced() const { return m_coalesced; }
+
+signals:
+    // GUI thread, after a pointer event reached the widgets
+    void pointerMoved(const QPoint& position);
+    void synced(quint64 token);
+
+protected:
+    void customEvent(QEvent* event) override;
+
+private:
+    struct Input
+    {
+        bool pointer = true;
+        bool moveOnly = false;
+        bool sourceGone = false;
+        const void* source = nullptr;
+        quint8 buttonMask = 0;
+        QPoint position;
+        bool down = false;
+        quint32 keysym = 0;
+        quint64 syncToken = 0; // set on postSync() markers, which deliver nothing
+    };
+
+    void post(const Input& input);
+    void deliverPointer(const Input& input);
+    void deliverKey(const Input& input);
+    QWidget* widgetAt(const QPoint& position) const;
+
+    QPointer<QWidget> m_root;
+
+    // filled by the sessions, drained by customEvent()
+    QMutex m_queueMutex;
+    QList<Input> m_queue;
+    bool m_flushPosted = false;
+    QHash<const void*, quint8> m_queuedButtonMasks; // of the newest pointer event queued per source
+    quint64 m_coalesced = 0; // guarded by m_queueMutex
+    quint64 m_nextSyncToken = 0; // guarded by m_queueMutex
+
+    // GUI thread state. m_buttonMask is what the widgets were told, all sources merged
+    QHash<const void*, quint8> m_sourceButtonMasks;
+    quint8 m_buttonMask = 0;
+    QPoint m_lastPosition;
+    // the widget that got the press keeps the moves and the release, like a real grab
+    QPointer<QWidget> m_grabWidget;
+    Qt::KeyboardModifiers m_modifiers = Qt::NoModifier;
+    quint64 m_delivered = 0;
+};
+
+#endif // INPUTINJECTOR_H
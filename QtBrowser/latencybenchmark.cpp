@@ -0,0 +1,222 @@
+#include "latencybenchmark.h"
+#include "vncserver.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QHostAddress>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QtEndian>
+
+static const int BENCHMARK_LATENCIES_MS[] = { 50, 150 };
+static const int WARMUP_MS = 2000;  // for the pacer to find its rate, not counted
+static const int MEASURE_MS = 5000;
+static const qint32 ENCODING_RAW = 0;
+static const qint32 ENCODING_CONTINUOUS_UPDATES = -313;
+static const quint8 FRAMEBUFFER_UPDATE = 0;
+static const quint8 BELL = 2;
+static const quint8 SERVER_CUT_TEXT = 3;
+static const quint8 END_OF_CONTINUOUS_UPDATES = 150;
+static const quint8 ENABLE_CONTINUOUS_UPDATES = 150;
+
+// just enough of a viewer to count updates: security None, the server's own pixel
+// format, raw only. Parses everything that arrives and asks for more the way a real
+// client in that mode would
+class BenchmarkClient
+{
+public:
+    explicit BenchmarkClient(bool continuous) : m_continuous(continuous) {
+        QObject::connect(&m_socket, &QTcpSocket::readyRead, &m_socket, [this]() { onReadyRead(); });
+    }
+
+    void connectTo(quint16 port) { m_socket.connectToHost(QHostAddress::LocalHost, port); }
+    void close() { m_socket.abort(); }
+
+    bool failed() const { return m_failed; }
+    // updates completed since the last call
+    int takeUpdates() {
+        const int updates = m_updates;
+        m_updates = 0;
+        return updates;
+    }
+
+private:
+    enum class State { Version, SecurityTypes, SecurityResult, ServerInit, Messages };
+
+    void onReadyRead() {
+        m_in.append(m_socket.readAll());
+        qsizetype used = 0;
+        while (!m_failed && parse(used)) {}
+        m_in.remove(0, used);
+    }
+
+    // one step at m_in[used], false when it needs more bytes
+    bool parse(qsizetype& used) {
+        const uchar* data = reinterpret_cast<const uchar*>(m_in.constData()) + used;
+        const qsizetype available = m_in.size() - used;
+        switch (m_state) {
+        case State::Version:
+            if (available < 12) return false;
+            used += 12;
+            m_socket.write("RFB 003.008\n", 12);
+            m_state = State::SecurityTypes;
+            return true;
+        case State::SecurityTypes:
+            if (available < 1 || available < 1 + data[0]) return false;
+            used += 1 + data[0];
+            m_socket.write("\x01", 1); // None
+            m_state = State::SecurityResult;
+            return true;
+        case State::SecurityResult:
+            if (available < 4) return false;
+            used += 4;
+            if (qFromBigEndian<quint32>(data) != 0) return fail("security handshake failed");
+            m_socket.write("\x01", 1); // ClientInit, shared
+            m_state = State::ServerInit;
+            return true;
+        case State::ServerInit: {
+            if (available < 24) return false;
+            const qsizetype nameLength = qFromBigEndian<quint32>(data + 20);
+            if (available < 24 + nameLength) return false;
+            used += 24 + nameLength;
+            m_width = qFromBigEndian<quint16>(data);
+            m_height = qFromBigEndian<quint16>(data + 2);
+            sendSetEncodings();
+            // the first update is a full one in either mode, continuous updates are
+            // switched on once the server said it has them
+            sendUpdateRequest(false);
+            m_state = State::Messages;
+            return true;
+        }
+        case State::Messages:
+            return parseMessage(data, available, used);
+        }
+        return false;
+    }
+
+    bool parseMessage(const uchar* data, qsizetype available, qsizetype& used) {
+        if (available < 1) return false;
+        switch (data[0]) {
+        case FRAMEBUFFER_UPDATE: {
+            if (available < 4) return false;
+            const int rects = qFromBigEndian<quint16>(data + 2);
+            qsizetype size = 4;
+            for (int i = 0; i < rects; ++i) {
+                if (available < size + 12) return false;
+                const uchar* header = data + size;
+                if (qFromBigEndian<qint32>(header + 8) != ENCODING_RAW)
+                    return fail("got an encoding we never asked for");
+                size += 12 + qsizetype(qFromBigEndian<quint16>(header + 4)) * qFromBigEndian<quint16>(header + 6) * 4;
+            }
+            if (available < size) return false;
+            used += size;
+            ++m_updates;
+            if (!m_continuous)
+                sendUpdateRequest(true);
+            return true;
+        }
+        case BELL:
+            used += 1;
+            return true;
+        case SERVER_CUT_TEXT: {
+            if (available < 8) return false;
+            const qsizetype size = 8 + qsizetype(qFromBigEndian<quint32>(data + 4));
+            if (available < size) return false;
+            used += size;
+            return true;
+        }
+        case END_OF_CONTINUOUS_UPDATES:
+            used += 1;
+            if (m_continuous && !m_enabledContinuous) {
+                uchar message[10];
+                message[0] = ENABLE_CONTINUOUS_UPDATES;
+                message[1] = 1;
+                qToBigEndian<quint16>(0, message + 2);
+                qToBigEndian<quint16>(0, message + 4);
+                qToBigEndian<quint16>(m_width, message + 6);
+                qToBigEndian<quint16>(m_height, message + 8);
+                m_socket.write(reinterpret_cast<const char*>(message), sizeof(message));
+                m_enabledContinuous = true;
+            }
+            return true;
+        default:
+            return fail(QString("unexpected server message %1").arg(int(data[0])));
+        }
+    }
+
+    void sendSetEncodings() {
+        QList<qint32> encodings = { ENCODING_RAW };
+        if (m_continuous)
+            encodings.append(ENCODING_CONTINUOUS_UPDATES);
+        QByteArray message(4 + encodings.size() * 4, 0);
+        uchar* out = reinterpret_cast<uchar*>(message.data());
+        out[0] = 2; // SetEncodings
+        qToBigEndian<quint16>(quint16(encodings.size()), out + 2);
+        for (int i = 0; i < encodings.size(); ++i)
+            qToBigEndian<qint32>(encodings.at(i), out + 4 + i * 4);
+        m_socket.write(message);
+    }
+
+    void sendUpdateRequest(bool incremental) {
+        uchar message[10];
+        message[0] = 3; // FramebufferUpdateRequest
+        message[1] = incremental ? 1 : 0;
+        qToBigEndian<quint16>(0, message + 2);
+        qToBigEndian<quint16>(0, message + 4);
+        qToBigEndian<quint16>(m_width, message + 6);
+        qToBigEndian<quint16>(m_height, message + 8);
+        m_socket.write(reinterpret_cast<const char*>(message), sizeof(message));
+    }
+
+    bool fail(const QString& reason) {
+        qWarning() << "[Server] latency benchmark client:" << reason;
+        m_failed = true;
+        return false;
+    }
+
+    QTcpSocket m_socket;
+    QByteArray m_in;
+    State m_state = State::Version;
+    bool m_continuous;
+    bool m_enabledContinuous = false;
+    bool m_failed = false;
+    quint16 m_width = 0;
+    quint16 m_height = 0;
+    int m_updates = 0;
+};
+
+static void waitMs(int ms) {
+    QEventLoop loop;
+    QTimer::singleShot(ms, &loop, &QEventLoop::quit);
+    loop.exec();
+}
+
+void benchmarkLatency(VncServer& server) {
+    if (!server.isListening() && !server.listen(QHostAddress::LocalHost, 0)) {
+        qWarning() << "[Server] latency benchmark could not listen:" << server.errorString();
+        return;
+    }
+
+    for (int latencyMs : BENCHMARK_LATENCIES_MS) {
+        // only sessions that connect from here on see the new latency
+        server.setSimulatedLatency(latencyMs);
+        for (bool continuous : { false, true }) {
+            BenchmarkClient client(continuous);
+            client.connectTo(server.serverPort());
+            waitMs(WARMUP_MS);
+            client.takeUpdates();
+
+            QElapsedTimer timer;
+            timer.start();
+            waitMs(MEASURE_MS);
+            const int updates = client.takeUpdates();
+            const double seconds = timer.nsecsElapsed() / 1e9;
+            client.close();
+            if (client.failed()) return;
+
+            qDebug().nospace() << "[Server] latency " << latencyMs << " ms, "
+                               << (continuous ? "continuous" : "request") << " updates: "
+                               << updates / seconds << " fps";
+        }
+    }
+}
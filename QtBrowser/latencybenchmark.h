@@ -0,0 +1,12 @@
+#ifndef LATENCYBENCHMARK_H
+#define LATENCYBENCHMARK_H
+
+class VncServer;
+
+// connects a minimal raw-only client to server once per update mode and simulated
+// round trip and logs how many updates per second it got: FramebufferUpdateRequest
+// after every update against continuous updates, at 50 and 150 ms. The page the server
+// shows has to keep changing. Blocks in a local event loop, run by --benchmark-latency
+void benchmarkLatency(VncServer& server);
+
+#endif // LATENCYBENCHMARK_H
@@ -1,7 +1,38 @@
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QRegularExpression>
+#include <QTimer>
+#include <cstring>
 #include "mainwindow.h"
+#include "encoderbenchmark.h"
+#include "tilehasher.h"
+#include "latencybenchmark.h"
+
+static const quint16 DEFAULT_VNC_PORT = 5901;
+static const QSize DEFAULT_VIEWPORT(1024, 768);
+static const int BENCHMARK_SETTLE_MS = 1000; // after loadFinished, for late layout and fonts
+// something that changes every frame, for --benchmark-latency
+static const char* BENCHMARK_ANIMATION_HTML =
+    "<html><body style='margin:0;background:#fff'>"
+    "<div id='box' style='position:absolute;width:200px;height:200px;background:#36c'></div>"
+    "<script>let t = 0; function step() { ++t; box.style.left = (t * 7 % 600) + 'px';"
+    " box.style.top = (t * 3 % 400) + 'px'; requestAnimationFrame(step); } step();</script>"
+    "</body></html>";
+
+// "1280x720" -> QSize, invalid on anything else
+static QSize parseSize(const QString& text) {
+    const QRegularExpressionMatch match = QRegularExpression("^(\\d+)x(\\d+)$").match(text.trimmed());
+    if (!match.hasMatch()) return QSize();
+    const QSize size(match.captured(1).toInt(), match.captured(2).toInt());
+    // RFB sends the framebuffer size as 16 bit values
+    if (size.isEmpty() || size.width() > 0xffff || size.height() > 0xffff) return QSize();
+    return size;
+}
 
 int main(int argc, char *argv[]) {
+    QElapsedTimer startupTimer;
+    startupTimer.start();
 
     // disable GPU acceleration in Qt WebEngine
     // this was for testin purposes. to speed the webbrowser back up upon building a release build
@@ -9,11 +40,150 @@ int main(int argc, char *argv[]) {
     QCoreApplication::setAttribute(Qt::AA_UseSoftwareOpenGL);
     qputenv("QTWEBENGINE_CHROMIUM_FLAGS", "--disable-gpu");
 
+    // the platform plugin gets picked while QApplication is constructed, so these
+    // flags have to be looked at before the real parser can run
+    bool headless = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--headless") == 0 || std::strcmp(argv[i], "--benchmark-encoders") == 0
+            || std::strcmp(argv[i], "--benchmark-scaling") == 0
+            || std::strcmp(argv[i], "--benchmark-latency") == 0
+            || std::strcmp(argv[i], "--benchmark-pixel-formats") == 0
+            || std::strcmp(argv[i], "--benchmark-tile-hash") == 0)
+            headless = true;
+    }
+    if (headless)
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
     QApplication app(argc, argv);
+    QApplication::setApplicationName("QtBrowser");
     QApplication::setStyle("Fusion"); // I just like the look of Fusion
 
-    MainWindow browser;
-    browser.show();
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Qt web browser with a built in VNC server");
+    parser.addHelpOption();
+    QCommandLineOption headlessOption("headless", "Run without a window and serve the page over VNC right away.");
+    QCommandLineOption portOption("port", "VNC listen port.", "port", QString::number(DEFAULT_VNC_PORT));
+    QCommandLineOption urlOption("url", "Page to load on startup.", "url", "about:blank");
+    QCommandLineOption sizeOption("size", "Viewport size as WIDTHxHEIGHT, the window size without --headless.", "size",
+                                  QString("%1x%2").arg(DEFAULT_VIEWPORT.width()).arg(DEFAULT_VIEWPORT.height()));
+    QCommandLineOption minFpsOption("min-fps", "Lowest update rate a busy session is paced down to.", "fps",
+                                    QString::number(FramePacer::DEFAULT_MIN_FPS));
+    QCommandLineOption maxFpsOption("max-fps", "Highest update rate any session gets.", "fps",
+                                    QString::number(FramePacer::DEFAULT_MAX_FPS));
+    QCommandLineOption latencyOption("simulate-latency", "Delay traffic both ways so a round trip takes "
+                                     "this many ms, to compare request and continuous updates over a slow link.", "ms", "0");
+    QCommandLineOption benchmarkOption("benchmark-pixel-formats", "Measure the pixel format conversion kernels and exit.");
+    QCommandLineOption encoderBenchmarkOption("benchmark-encoders", "Capture --url at --size, measure every "
+                                              "encoder on that frame and exit.");
+    QCommandLineOption scalingBenchmarkOption("benchmark-scaling", "Capture --url at --size, encode that frame "
+                                              "with 1 up to one thread per core and exit.");
+    QCommandLineOption tileHashBenchmarkOption("benchmark-tile-hash", "Measure the tile hash kernels and exit.");
+    QCommandLineOption latencyBenchmarkOption("benchmark-latency", "Serve an animation at --size to a built in "
+                                              "client, log the update rate of request and continuous updates "
+                                              "at 50 and 150 ms round trips and exit.");
+    parser.addOptions({ headlessOption, portOption, urlOption, sizeOption, minFpsOption, maxFpsOption, latencyOption,
+                        benchmarkOption, encoderBenchmarkOption, scalingBenchmarkOption, tileHashBenchmarkOption,
+                        latencyBenchmarkOption });
+    parser.process(app);
+
+    if (parser.isSet(benchmarkOption)) {
+        PixelConverter::benchmark();
+        return 0;
+    }
+    if (parser.isSet(tileHashBenchmarkOption)) {
+        TileHasher::benchmark();
+        return 0;
+    }
+
+    bool ok = false;
+    const uint port = parser.value(portOption).toUInt(&ok);
+    if (!ok || port > 0xffff) {
+        qWarning() << "Invalid port:" << parser.value(portOption);
+        return 1;
+    }
+    const QSize viewport = parseSize(parser.value(sizeOption));
+    if (!viewport.isValid()) {
+        qWarning() << "Invalid size, expected WIDTHxHEIGHT:" << parser.value(sizeOption);
+        return 1;
+    }
+    const double minFps = parser.value(minFpsOption).toDouble();
+    const double maxFps = parser.value(maxFpsOption).toDouble();
+    const int latencyMs = parser.value(latencyOption).toInt(&ok);
+    if (!ok || latencyMs < 0) {
+        qWarning() << "Invalid latency:" << parser.value(latencyOption);
+        return 1;
+    }
+
+    const bool encoderBenchmark = parser.isSet(encoderBenchmarkOption);
+    const bool scalingBenchmark = parser.isSet(scalingBenchmarkOption);
+    if (encoderBenchmark || scalingBenchmark) {
+        // a real page is the only honest input, synthetic frames compress too well
+        WebView view;
+        view.resize(viewport);
+        view.show();
+        FrameSource frameSource(&view);
+        QObject::connect(&frameSource, &FrameSource::frameReady, &app,
+                         [&app, encoderBenchmark, scalingBenchmark](const FramePtr& frame) {
+            if (encoderBenchmark) benchmarkEncoders(frame->image);
+            if (scalingBenchmark) benchmarkEncodeScaling(frame->image);
+            app.quit();
+        });
+        QObject::connect(&view, &QWebEngineView::loadFinished, &app, [&frameSource](bool ok) {
+            if (!ok) qWarning() << "[Server] page failed to load, benchmarking whatever is shown";
+            QTimer::singleShot(BENCHMARK_SETTLE_MS, &frameSource, &FrameSource::requestFrame);
+        });
+        view.load(QUrl::fromUserInput(parser.value(urlOption)));
+        return app.exec();
+    }
+
+    if (parser.isSet(latencyBenchmarkOption)) {
+        WebView view;
+        view.resize(viewport);
+        view.show();
+        VncServer server(&view);
+        server.setFrameRateLimits(minFps, maxFps);
+        QObject::connect(&view, &QWebEngineView::loadFinished, &app, [&app, &server](bool) {
+            QTimer::singleShot(BENCHMARK_SETTLE_MS, &app, [&app, &server]() {
+                benchmarkLatency(server);
+                app.quit();
+            });
+        });
+        view.setHtml(BENCHMARK_ANIMATION_HTML);
+        return app.exec();
+    }
+
+    if (!parser.isSet(headlessOption)) {
+        MainWindow browser;
+        browser.setFrameRateLimits(minFps, maxFps);
+        browser.setSimulatedLatency(latencyMs);
+        browser.setVncPort(quint16(port));
+        // the defaults only matter headless, a window keeps its own size and blank tab
+        if (parser.isSet(sizeOption))
+            browser.resize(viewport);
+        if (parser.isSet(urlOption))
+            browser.currentWebView()->setUrl(QUrl::fromUserInput(parser.value(urlOption)));
+        browser.show();
+        return app.exec();
+    }
+
+    // headless: no browser chrome, the VNC client sees exactly the page at the requested
+    // size. The offscreen platform still paints, so damage tracking works as usual
+    WebView view;
+    view.resize(viewport);
+    view.show();
+
+    VncServer server(&view);
+    server.setFrameRateLimits(minFps, maxFps);
+    server.setSimulatedLatency(latencyMs);
+    if (!server.listen(QHostAddress::Any, quint16(port))) {
+        qWarning() << "Failed to start VNC server:" << server.errorString();
+        return 1;
+    }
+    qDebug() << "[Server] headless, listening on port" << server.serverPort() << "viewport" << viewport
+             << "startup to listening ms:" << startupTimer.elapsed();
+
+    // loading is asynchronous, the server is already accepting while chromium spins up
+    view.load(QUrl::fromUserInput(parser.value(urlOption)));
 
     return app.exec();
 }
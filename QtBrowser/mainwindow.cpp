@@ -8,6 +8,7 @@
 #include <QUrlQuery>
 #include <QtWebEngineCore/QWebEnginePage>
 #include <QtWebEngineCore/QWebEngineHistory>
+#include <QtWebEngineCore/QWebEngineNewWindowRequest>
 #include <QMenu>
 #include <QMessageBox>
 #include <QNetworkInterface>
@@ -104,7 +105,9 @@ void MainWindow::onToggleVnc() {
         qDebug() << "Starting VNC server...";
         // pass the entire MainWindow (this) to capture all UI elements
         vncServer = new VncServer(centralWidget(), this);
-        if (vncServer->listen(QHostAddress::Any, 5901)) {
+        vncServer->setFrameRateLimits(minFps, maxFps);
+        vncServer->setSimulatedLatency(simulatedLatencyMs);
+        if (vncServer->listen(QHostAddress::Any, vncPort)) {
             QString ip = getLocalIpAddress();
             qDebug() << "VNC server listening on" << ip << ":" << vncServer->serverPort();
             vncEnabled = true;
@@ -135,6 +138,19 @@ void MainWindow::onToggleVnc() {
         action->setChecked(vncEnabled);
 }
 
+void MainWindow::setFrameRateLimits(double minFps, double maxFps) {
+    this->minFps = minFps;
+    this->maxFps = maxFps;
+}
+
+void MainWindow::setSimulatedLatency(int ms) {
+    simulatedLatencyMs = ms;
+}
+
+void MainWindow::setVncPort(quint16 port) {
+    vncPort = port;
+}
+
 QWebEngineView* MainWindow::currentWebView() const {
     // get the current widget in the tab widget and cast to QWebEngineView
     return qobject_cast<QWebEngineView*>(tabWidget->currentWidget());
@@ -227,10 +243,23 @@ void MainWindow::onNewTab() {
     webView->setUrl(QUrl("about:blank"));
 }
 
+WebView::WebView(QWidget *parent) : QWebEngineView(parent) {
+    // headless mode has no tabs and the VNC server only ever shows this view, so a
+    // popup's url just replaces the page here. The signal comes before createWindow(),
+    // which then turns the new window itself down
+    connect(page(), &QWebEnginePage::newWindowRequested, this, [this](QWebEngineNewWindowRequest &request) {
+        if (!qobject_cast<MainWindow*>(window()) && request.requestedUrl().isValid())
+            setUrl(request.requestedUrl());
+    });
+}
+
 QWebEngineView* WebView::createWindow(QWebEnginePage::WebWindowType type) {
     // handle requests to open a new window (tab) by creating a new tab in the existing browser
+    Q_UNUSED(type);
     MainWindow *mainWin = qobject_cast<MainWindow*>(window());
     if (!mainWin) {
+        // returning this view would hand chromium a page that already has contents,
+        // which it refuses. newWindowRequested loaded the url here already
         return nullptr;
     }
     // always open new window requests as a foreground tab in this implementation
@@ -18,6 +18,12 @@ public:
     // helper to get the current tabs QWebEngineView
     QWebEngineView* currentWebView() const;
     void onToggleVnc();
+    // pacing range handed to the VNC server whenever it gets started
+    void setFrameRateLimits(double minFps, double maxFps);
+    // client input delay for trying the server over a slow link, see VncServer
+    void setSimulatedLatency(int ms);
+    // port the VNC server listens on once it gets started
+    void setVncPort(quint16 port);
 
 private slots:
     void onAddressEntered();
@@ -37,13 +43,17 @@ private:
 
     bool vncEnabled = false;
     VncServer *vncServer = nullptr;
+    double minFps = FramePacer::DEFAULT_MIN_FPS;
+    double maxFps = FramePacer::DEFAULT_MAX_FPS;
+    int simulatedLatencyMs = 0;
+    quint16 vncPort = 5901;
 };
 
 /// Custom QWebEngineView to handle new window/tab requests
 class WebView : public QWebEngineView {
     Q_OBJECT
 public:
-    explicit WebView(QWidget *parent = nullptr) : QWebEngineView(parent) {}
+    explicit WebView(QWidget *parent = nullptr);
 
 protected:
     // override to handle requests to open new windows
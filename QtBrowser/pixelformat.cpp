@@ -0,0 +1,359 @@
+#include "pixelformat.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QtEndian>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PIXELFORMAT_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PIXELFORMAT_AVX2_TARGET
+#else
+#define PIXELFORMAT_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+// channel positions in a captured Format_RGB32 word
+static const int SOURCE_SHIFT[3] = { 16, 8, 0 };
+
+PixelFormat PixelFormat::native() {
+    PixelFormat format;
+    format.bigEndian = Q_BYTE_ORDER == Q_BIG_ENDIAN;
+    return format;
+}
+
+PixelFormat PixelFormat::fromWire(const uchar* bytes) {
+    PixelFormat format;
+    format.bitsPerPixel = bytes[0];
+    format.depth = bytes[1];
+    format.bigEndian = bytes[2] != 0;
+    format.trueColour = bytes[3] != 0;
+    format.redMax = qFromBigEndian<quint16>(bytes + 4);
+    format.greenMax = qFromBigEndian<quint16>(bytes + 6);
+    format.blueMax = qFromBigEndian<quint16>(bytes + 8);
+    format.redShift = bytes[10];
+    format.greenShift = bytes[11];
+    format.blueShift = bytes[12];
+    return format;
+}
+
+void PixelFormat::toWire(uchar* bytes) const {
+    bytes[0] = bitsPerPixel;
+    bytes[1] = depth;
+    bytes[2] = bigEndian ? 1 : 0;
+    bytes[3] = trueColour ? 1 : 0;
+    qToBigEndian<quint16>(redMax, bytes + 4);
+    qToBigEndian<quint16>(greenMax, bytes + 6);
+    qToBigEndian<quint16>(blueMax, bytes + 8);
+    bytes[10] = redShift;
+    bytes[11] = greenShift;
+    bytes[12] = blueShift;
+    bytes[13] = bytes[14] = bytes[15] = 0; // padding
+}
+
+bool PixelFormat::isValid() const {
+    if (!trueColour) return false;
+    if (bitsPerPixel != 8 && bitsPerPixel != 16 && bitsPerPixel != 32) return false;
+    const quint16 maxes[3] = { redMax, greenMax, blueMax };
+    const quint8 shifts[3] = { redShift, greenShift, blueShift };
+    for (int c = 0; c < 3; ++c) {
+        if (maxes[c] == 0 || shifts[c] >= bitsPerPixel) return false;
+        if ((quint64(maxes[c]) << shifts[c]) >> bitsPerPixel) return false;
+    }
+    return true;
+}
+
+bool PixelFormat::operator==(const PixelFormat& other) const {
+    // depth is informational, and byte order means nothing for a single byte
+    return bitsPerPixel == other.bitsPerPixel
+        && (bitsPerPixel == 8 || bigEndian == other.bigEndian)
+        && trueColour == other.trueColour
+        && redMax == other.redMax && greenMax == other.greenMax && blueMax == other.blueMax
+        && redShift == other.redShift && greenShift == other.greenShift && blueShift == other.blueShift;
+}
+
+// number of bits in max if it is 2^n - 1 with n <= 8, 0 otherwise
+static int channelBits(quint16 max) {
+    for (int bits = 1; bits <= 8; ++bits) {
+        if (max == (1u << bits) - 1) return bits;
+    }
+    return 0;
+}
+
+static inline void storePixel(uchar* dst, quint32 value, const PixelConverter::Params& params) {
+    switch (params.bytesPerPixel) {
+    case 4: {
+        const quint32 v = params.swapBytes ? qbswap(value) : value;
+        std::memcpy(dst, &v, 4);
+        break;
+    }
+    case 2: {
+        const quint16 v = params.swapBytes ? qbswap(quint16(value)) : quint16(value);
+        std::memcpy(dst, &v, 2);
+        break;
+    }
+    default:
+        *dst = uchar(value);
+        break;
+    }
+}
+
+// any format at all: every channel value is scaled through a table that already holds
+// the shifted output bits
+static void convertScalar(const quint32* src, uchar* dst, int count, const PixelConverter::Params& params) {
+    for (int i = 0; i < count; ++i) {
+        const quint32 p = src[i];
+        const quint32 value = params.table[0][(p >> 16) & 0xff]
+                            | params.table[1][(p >> 8) & 0xff]
+                            | params.table[2][p & 0xff];
+        storePixel(dst + i * params.bytesPerPixel, value, params);
+    }
+}
+
+#ifdef PIXELFORMAT_X86
+
+// the vector kernels handle channels of 2^n - 1: keep the top n bits of each source
+// channel and move them into place, ((p >> right) & mask) << left, all lanes at once.
+// The shift counts are the same for every lane so the plain SSE2 shifts do it
+
+static inline __m128i pack4(__m128i v, const __m128i right[3], const __m128i mask[3], const __m128i left[3]) {
+    __m128i out = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, right[0]), mask[0]), left[0]);
+    out = _mm_or_si128(out, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, right[1]), mask[1]), left[1]));
+    return _mm_or_si128(out, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, right[2]), mask[2]), left[2]));
+}
+
+// sign extends the low 16 bits so _mm_packs_epi32 keeps them instead of saturating
+static inline __m128i low16(__m128i v) {
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+static inline __m128i swap16(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline __m128i swap32(__m128i v) {
+    v = swap16(v);
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static void convertSse2(const quint32* src, uchar* dst, int count, const PixelConverter::Params& params) {
+    __m128i right[3], mask[3], left[3];
+    for (int c = 0; c < 3; ++c) {
+        right[c] = _mm_cvtsi32_si128(params.rightShift[c]);
+        mask[c] = _mm_set1_epi32(int(params.mask[c]));
+        left[c] = _mm_cvtsi32_si128(params.leftShift[c]);
+    }
+    auto load = [&](int i) {
+        return pack4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), right, mask, left);
+    };
+
+    int i = 0;
+    switch (params.bytesPerPixel) {
+    case 4:
+        for (; i + 4 <= count; i += 4) {
+            __m128i out = load(i);
+            if (params.swapBytes) out = swap32(out);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), out);
+        }
+        break;
+    case 2:
+        for (; i + 8 <= count; i += 8) {
+            __m128i out = _mm_packs_epi32(low16(load(i)), low16(load(i + 4)));
+            if (params.swapBytes) out = swap16(out);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2), out);
+        }
+        break;
+    default:
+        // values are below 256 here, both packs pass them through untouched
+        for (; i + 16 <= count; i += 16) {
+            const __m128i a = _mm_packs_epi32(load(i), load(i + 4));
+            const __m128i b = _mm_packs_epi32(load(i + 8), load(i + 12));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(a, b));
+        }
+        break;
+    }
+    convertScalar(src + i, dst + i * params.bytesPerPixel, count - i, params);
+}
+
+PIXELFORMAT_AVX2_TARGET
+static inline __m256i pack8(const quint32* src, const __m128i right[3], const __m256i mask[3], const __m128i left[3]) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    __m256i out = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(v, right[0]), mask[0]), left[0]);
+    out = _mm256_or_si256(out, _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(v, right[1]), mask[1]), left[1]));
+    return _mm256_or_si256(out, _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(v, right[2]), mask[2]), left[2]));
+}
+
+PIXELFORMAT_AVX2_TARGET
+static void convertAvx2(const quint32* src, uchar* dst, int count, const PixelConverter::Params& params) {
+    __m128i right[3], left[3];
+    __m256i mask[3];
+    for (int c = 0; c < 3; ++c) {
+        right[c] = _mm_cvtsi32_si128(params.rightShift[c]);
+        mask[c] = _mm256_set1_epi32(int(params.mask[c]));
+        left[c] = _mm_cvtsi32_si128(params.leftShift[c]);
+    }
+    const __m256i swap32Mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i swap16Mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                                1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    // the 256 bit packs work per 128 bit half, these put the pieces back in order
+    const __m256i bytesOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int i = 0;
+    switch (params.bytesPerPixel) {
+    case 4:
+        for (; i + 8 <= count; i += 8) {
+            __m256i out = pack8(src + i, right, mask, left);
+            if (params.swapBytes) out = _mm256_shuffle_epi8(out, swap32Mask);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), out);
+        }
+        break;
+    case 2:
+        for (; i + 16 <= count; i += 16) {
+            const __m256i a = _mm256_srai_epi32(_mm256_slli_epi32(pack8(src + i, right, mask, left), 16), 16);
+            const __m256i b = _mm256_srai_epi32(_mm256_slli_epi32(pack8(src + i + 8, right, mask, left), 16), 16);
+            __m256i out = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+            if (params.swapBytes) out = _mm256_shuffle_epi8(out, swap16Mask);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 2), out);
+        }
+        break;
+    default:
+        for (; i + 32 <= count; i += 32) {
+            const __m256i a = _mm256_packs_epi32(pack8(src + i, right, mask, left), pack8(src + i + 8, right, mask, left));
+            const __m256i b = _mm256_packs_epi32(pack8(src + i + 16, right, mask, left), pack8(src + i + 24, right, mask, left));
+            const __m256i out = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, b), bytesOrder);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), out);
+        }
+        break;
+    }
+    convertScalar(src + i, dst + i * params.bytesPerPixel, count - i, params);
+}
+
+static bool cpuHasAvx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    // the OS has to save the ymm registers too, not just the CPU have them
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // PIXELFORMAT_X86
+
+PixelConverter::PixelConverter(const PixelFormat& format)
+    : m_format(format)
+{
+    m_identity = format == PixelFormat::native();
+
+    m_params.bytesPerPixel = format.bytesPerPixel();
+    m_params.swapBytes = format.bitsPerPixel > 8 && format.bigEndian != (Q_BYTE_ORDER == Q_BIG_ENDIAN);
+
+    const quint16 maxes[3] = { format.redMax, format.greenMax, format.blueMax };
+    const quint8 shifts[3] = { format.redShift, format.greenShift, format.blueShift };
+    bool vectorizable = true;
+    for (int c = 0; c < 3; ++c) {
+        // 2^n - 1 maxes keep the top n bits, exactly what the vector kernels do, so the
+        // picture doesn't depend on which kernel the CPU got. Anything else is scaled
+        const int bits = channelBits(maxes[c]);
+        for (int v = 0; v < 256; ++v) {
+            const quint32 value = bits ? quint32(v) >> (8 - bits) : (quint32(v) * maxes[c] + 127) / 255;
+            m_params.table[c][v] = value << shifts[c];
+        }
+
+        if (bits == 0) vectorizable = false;
+        m_params.rightShift[c] = SOURCE_SHIFT[c] + 8 - bits;
+        m_params.mask[c] = maxes[c];
+        m_params.leftShift[c] = shifts[c];
+    }
+
+    m_kernel = convertScalar;
+    m_kernelName = "scalar";
+#ifdef PIXELFORMAT_X86
+    if (vectorizable) {
+        static const bool avx2 = cpuHasAvx2();
+        m_kernel = avx2 ? convertAvx2 : convertSse2;
+        m_kernelName = avx2 ? "avx2" : "sse2";
+    }
+#else
+    Q_UNUSED(vectorizable);
+#endif
+}
+
+void PixelConverter::benchmark() {
+    const int width = 1920;
+    const int height = 1080;
+    const int rounds = 20;
+
+    QVector<quint32> frame(width * height);
+    quint32 seed = 0x12345678;
+    for (quint32& pixel : frame) {
+        seed = seed * 1664525u + 1013904223u;
+        pixel = 0xff000000u | (seed >> 8);
+    }
+    QVector<uchar> out(frame.size() * 4);
+
+    struct Case { const char* name; PixelFormat format; };
+    QVector<Case> cases;
+    PixelFormat swapped = PixelFormat::native();
+    swapped.bigEndian = !swapped.bigEndian;
+    cases.append({ "32bpp byte swapped", swapped });
+    PixelFormat rgb565;
+    rgb565.bitsPerPixel = 16; rgb565.depth = 16;
+    rgb565.redMax = 31; rgb565.greenMax = 63; rgb565.blueMax = 31;
+    rgb565.redShift = 11; rgb565.greenShift = 5; rgb565.blueShift = 0;
+    rgb565.bigEndian = false;
+    cases.append({ "16bpp 565 little endian", rgb565 });
+    rgb565.bigEndian = true;
+    cases.append({ "16bpp 565 big endian", rgb565 });
+    PixelFormat bgr233;
+    bgr233.bitsPerPixel = 8; bgr233.depth = 8;
+    bgr233.redMax = 7; bgr233.greenMax = 7; bgr233.blueMax = 3;
+    bgr233.redShift = 0; bgr233.greenShift = 3; bgr233.blueShift = 6;
+    cases.append({ "8bpp BGR233", bgr233 });
+    PixelFormat odd = rgb565;
+    odd.redMax = 20; odd.greenMax = 40; odd.blueMax = 20;
+    cases.append({ "16bpp odd maxes", odd });
+
+    struct Variant { const char* name; Kernel kernel; };
+    QVector<Variant> variants;
+    variants.append({ "scalar", convertScalar });
+#ifdef PIXELFORMAT_X86
+    variants.append({ "sse2", convertSse2 });
+    if (cpuHasAvx2())
+        variants.append({ "avx2", convertAvx2 });
+#endif
+
+    for (const Case& test : cases) {
+        const PixelConverter converter(test.format);
+        for (const Variant& variant : variants) {
+            // the vector kernels only understand 2^n - 1 maxes
+            if (variant.kernel != convertScalar && converter.m_kernel == convertScalar) continue;
+
+            QElapsedTimer timer;
+            timer.start();
+            for (int round = 0; round < rounds; ++round) {
+                for (int y = 0; y < height; ++y) {
+                    variant.kernel(frame.constData() + y * width, out.data() + y * width * converter.m_params.bytesPerPixel,
+                                   width, converter.m_params);
+                }
+            }
+            const double seconds = qMax<qint64>(1, timer.nsecsElapsed()) / 1e9;
+            const double gigabytes = double(frame.size()) * 4 * rounds / 1e9;
+            qDebug().nospace() << "[Server] pixel kernel " << variant.name << " " << test.name << ": "
+                               << gigabytes / seconds << " GB/s";
+        }
+    }
+}
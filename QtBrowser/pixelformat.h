@@ -0,0 +1,78 @@
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <QtGlobal>
+
+// the 16 byte PIXEL_FORMAT structure from ServerInit and SetPixelFormat
+struct PixelFormat
+{
+    quint8 bitsPerPixel = 32;
+    quint8 depth = 24;
+    bool bigEndian = false;
+    bool trueColour = true;
+    quint16 redMax = 255;
+    quint16 greenMax = 255;
+    quint16 blueMax = 255;
+    quint8 redShift = 16;
+    quint8 greenShift = 8;
+    quint8 blueShift = 0;
+
+    // how a Format_RGB32 frame sits in memory on this host, what we advertise
+    static PixelFormat native();
+    static PixelFormat fromWire(const uchar* bytes);
+    void toWire(uchar* bytes) const;
+
+    // 8, 16 or 32 bits per pixel, true colour, every channel fits in the pixel. We
+    // have no colour map support
+    bool isValid() const;
+    int bytesPerPixel() const { return bitsPerPixel / 8; }
+    bool operator==(const PixelFormat& other) const;
+};
+
+// PixelConverter turns rows of captured pixels (Format_RGB32 words) into whatever a
+// client asked for with SetPixelFormat. The kernel is picked once when the format is
+// set: AVX2 or SSE2 depending on what the CPU running us has, for any format whose
+// channel maxes are 2^n - 1 (565, 555, BGR233, byte swapped 32 bit...), and a table
+// driven scalar loop for everything else. Sessions in the native format never call
+// convert(), their rows go out untouched
+class PixelConverter
+{
+public:
+    // channel positions and shifts the kernels work from, derived from the format
+    struct Params
+    {
+        int bytesPerPixel = 4;
+        bool swapBytes = false;
+        int rightShift[3] = { 0, 0, 0 }; // moves the channel's top bits down to bit 0
+        quint32 mask[3] = { 0, 0, 0 };
+        int leftShift[3] = { 0, 0, 0 };
+        quint32 table[3][256]; // output bits for every 8 bit channel value
+    };
+    using Kernel = void (*)(const quint32* src, uchar* dst, int count, const Params& params);
+
+    explicit PixelConverter(const PixelFormat& format = PixelFormat::native());
+
+    const PixelFormat& format() const { return m_format; }
+    // the client takes our pixels as they are
+    bool isIdentity() const { return m_identity; }
+    const char* kernelName() const { return m_kernelName; }
+
+    // count pixels from src, bytesPerPixel() * count bytes to dst. Thread safe, the
+    // encoder calls it from every worker at once
+    void convert(const quint32* src, uchar* dst, int count) const {
+        m_kernel(src, dst, count, m_params);
+    }
+
+    // every kernel on a 1080p frame for a handful of formats, logged in GB/s of source
+    // pixels. Run by --benchmark-pixel-formats
+    static void benchmark();
+
+private:
+    PixelFormat m_format;
+    bool m_identity = true;
+    Params m_params;
+    Kernel m_kernel = nullptr;
+    const char* m_kernelName = "";
+};
+
+#endif // PIXELFORMAT_H
@@ -0,0 +1,213 @@
+#include "rfbinput.h"
+#include <QtEndian>
+#include <cstring>
+
+static qsizetype nextPowerOfTwo(qsizetype n) {
+    qsizetype capacity = 1;
+    while (capacity < n)
+        capacity <<= 1;
+    return capacity;
+}
+
+RfbInput::RfbInput(qsizetype capacity)
+{
+    m_data.resize(nextPowerOfTwo(qMax<qsizetype>(capacity, 64)));
+}
+
+qint64 RfbInput::readFrom(QIODevice* device) {
+    qint64 total = 0;
+    while (!isFull()) {
+        // free space runs from the tail up to the end of the array, or up to the head
+        // once the tail wrapped around
+        const qsizetype tail = (m_head + m_size) & (capacity() - 1);
+        const qsizetype span = tail >= m_head ? capacity() - tail : m_head - tail;
+        const qint64 got = device->read(m_data.data() + tail, span);
+        if (got <= 0) break;
+        m_size += got;
+        total += got;
+        if (got < span) break; // the device ran dry
+    }
+    return total;
+}
+
+void RfbInput::peek(void* dst, qsizetype n, qsizetype offset) const {
+    Q_ASSERT(offset + n <= m_size);
+    const qsizetype start = (m_head + offset) & (capacity() - 1);
+    const qsizetype first = qMin(n, capacity() - start);
+    std::memcpy(dst, m_data.constData() + start, first);
+    if (first < n)
+        std::memcpy(static_cast<char*>(dst) + first, m_data.constData(), n - first);
+}
+
+void RfbInput::consume(qsizetype n) {
+    Q_ASSERT(n <= m_size);
+    m_head = (m_head + n) & (capacity() - 1);
+    m_size -= n;
+    if (m_size == 0) m_head = 0; // keeps the next read in one piece
+}
+
+void RfbInput::reserve(qsizetype n) {
+    if (n <= capacity()) return;
+    QByteArray grown(nextPowerOfTwo(n), Qt::Uninitialized);
+    peek(grown.data(), m_size);
+    m_data = grown;
+    m_head = 0;
+}
+
+void RfbInput::append(const char* data, qsizetype n) {
+    reserve(m_size + n);
+    const qsizetype tail = (m_head + m_size) & (capacity() - 1);
+    const qsizetype first = qMin(n, capacity() - tail);
+    std::memcpy(m_data.data() + tail, data, first);
+    if (first < n)
+        std::memcpy(m_data.data(), data + first, n - first);
+    m_size += n;
+}
+
+bool RfbInput::take(void* dst, qsizetype n) {
+    if (m_size < n) return false;
+    peek(dst, n);
+    consume(n);
+    return true;
+}
+
+RfbInput::Status RfbInput::next(ClientMessage& message) {
+    if (m_inCutText) {
+        // stream the body through, keeping at most MAX_CUT_TEXT of it
+        const qsizetype chunk = qMin<qsizetype>(m_size, m_cutTextRemaining);
+        const qsizetype keep = qMin(chunk, MAX_CUT_TEXT - m_cutText.size());
+        if (keep > 0) {
+            const qsizetype at = m_cutText.size();
+            m_cutText.resize(at + keep);
+            peek(m_cutText.data() + at, keep);
+        }
+        consume(chunk);
+        m_cutTextRemaining -= quint32(chunk);
+        if (m_cutTextRemaining > 0) return Status::Incomplete;
+
+        m_inCutText = false;
+        message.type = ClientMessage::ClientCutText;
+        message.text = m_cutText;
+        m_cutText.clear();
+        return Status::Ready;
+    }
+
+    if (m_size == 0) return Status::Incomplete;
+
+    // every header is at most 20 bytes, peeking it out keeps the decoding below free
+    // of wrap around checks
+    uchar header[20];
+    peek(header, 1);
+    switch (header[0]) {
+    case ClientMessage::SetPixelFormat:
+        if (m_size < 20) return Status::Incomplete;
+        peek(header, 20);
+        message.type = ClientMessage::SetPixelFormat;
+        message.pixelFormat = PixelFormat::fromWire(header + 4);
+        consume(20);
+        return Status::Ready;
+
+    case ClientMessage::SetEncodings: {
+        if (m_size < 4) return Status::Incomplete;
+        peek(header, 4);
+        const quint16 count = qFromBigEndian<quint16>(header + 2);
+        const qsizetype length = 4 + qsizetype(count) * 4;
+        if (m_size < length) {
+            reserve(length);
+            return Status::Incomplete;
+        }
+        message.type = ClientMessage::SetEncodings;
+        message.encodings.resize(count);
+        for (int i = 0; i < count; ++i) {
+            uchar encoding[4];
+            peek(encoding, 4, 4 + i * 4);
+            message.encodings[i] = qFromBigEndian<qint32>(encoding);
+        }
+        consume(length);
+        return Status::Ready;
+    }
+
+    case ClientMessage::FramebufferUpdateRequest:
+        if (m_size < 10) return Status::Incomplete;
+        peek(header, 10);
+        message.type = ClientMessage::FramebufferUpdateRequest;
+        message.incremental = header[1] != 0;
+        message.rect = QRect(qFromBigEndian<quint16>(header + 2), qFromBigEndian<quint16>(header + 4),
+                             qFromBigEndian<quint16>(header + 6), qFromBigEndian<quint16>(header + 8));
+        consume(10);
+        return Status::Ready;
+
+    case ClientMessage::KeyEvent:
+        if (m_size < 8) return Status::Incomplete;
+        peek(header, 8);
+        message.type = ClientMessage::KeyEvent;
+        message.down = header[1] != 0;
+        message.keysym = qFromBigEndian<quint32>(header + 4);
+        consume(8);
+        return Status::Ready;
+
+    case ClientMessage::PointerEvent:
+        if (m_size < 6) return Status::Incomplete;
+        peek(header, 6);
+        message.type = ClientMessage::PointerEvent;
+        message.buttonMask = header[1];
+        message.position = QPoint(qFromBigEndian<quint16>(header + 2), qFromBigEndian<quint16>(header + 4));
+        consume(6);
+        return Status::Ready;
+
+    case ClientMessage::ClientCutText:
+        if (m_size < 8) return Status::Incomplete;
+        peek(header, 8);
+        m_cutTextRemaining = qFromBigEndian<quint32>(header + 4);
+        consume(8);
+        m_inCutText = true;
+        return next(message);
+
+    case ClientMessage::EnableContinuousUpdates:
+        if (m_size < 10) return Status::Incomplete;
+        peek(header, 10);
+        message.type = ClientMessage::EnableContinuousUpdates;
+        message.enable = header[1] != 0;
+        message.rect = QRect(qFromBigEndian<quint16>(header + 2), qFromBigEndian<quint16>(header + 4),
+                             qFromBigEndian<quint16>(header + 6), qFromBigEndian<quint16>(header + 8));
+        consume(10);
+        return Status::Ready;
+
+    case ClientMessage::Fence: {
+        if (m_size < 9) return Status::Incomplete;
+        peek(header, 9);
+        const quint8 length = header[8];
+        if (length > MAX_FENCE_PAYLOAD) return Status::Invalid;
+        if (m_size < 9 + length) {
+            reserve(9 + length);
+            return Status::Incomplete;
+        }
+        message.type = ClientMessage::Fence;
+        message.fenceFlags = qFromBigEndian<quint32>(header + 4);
+        message.fencePayload.resize(length);
+        if (length > 0)
+            peek(message.fencePayload.data(), length, 9);
+        consume(9 + length);
+        return Status::Ready;
+    }
+
+    case ClientMessage::SetDesktopSize: {
+        if (m_size < 8) return Status::Incomplete;
+        peek(header, 8);
+        const quint8 screenCount = header[6];
+        const qsizetype length = 8 + qsizetype(screenCount) * 16;
+        if (m_size < length) {
+            reserve(length);
+            return Status::Incomplete;
+        }
+        message.type = ClientMessage::SetDesktopSize;
+        message.desktopSize = QSize(qFromBigEndian<quint16>(header + 2), qFromBigEndian<quint16>(header + 4));
+        message.screenCount = screenCount;
+        consume(length);
+        return Status::Ready;
+    }
+
+    default:
+        return Status::Invalid;
+    }
+}
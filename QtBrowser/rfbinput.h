@@ -0,0 +1,96 @@
+#ifndef RFBINPUT_H
+#define RFBINPUT_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+#include <QVector>
+#include "pixelformat.h"
+
+// one decoded client to server message. The same object is reused for every message,
+// so the encodings list keeps its capacity
+struct ClientMessage
+{
+    enum Type : quint8 {
+        SetPixelFormat = 0,
+        SetEncodings = 2,
+        FramebufferUpdateRequest = 3,
+        KeyEvent = 4,
+        PointerEvent = 5,
+        ClientCutText = 6,
+        EnableContinuousUpdates = 150,
+        Fence = 248,
+        SetDesktopSize = 251
+    };
+
+    Type type = SetPixelFormat;
+    PixelFormat pixelFormat;    // SetPixelFormat
+    QVector<qint32> encodings;  // SetEncodings, in the clients order of preference
+    bool incremental = false;   // FramebufferUpdateRequest
+    QRect rect;                 // FramebufferUpdateRequest and EnableContinuousUpdates
+    bool enable = false;        // EnableContinuousUpdates
+    bool down = false;          // KeyEvent
+    quint32 keysym = 0;
+    quint8 buttonMask = 0;      // PointerEvent
+    QPoint position;
+    QByteArray text;            // ClientCutText, latin-1, cut off at MAX_CUT_TEXT
+    QSize desktopSize;          // SetDesktopSize, the screen layout itself is skipped
+    quint8 screenCount = 0;
+    quint32 fenceFlags = 0;     // Fence
+    QByteArray fencePayload;    // at most MAX_FENCE_PAYLOAD bytes
+};
+
+// RfbInput is the receive side of a session: a ring buffer the socket is read into
+// directly, plus an incremental parser over it. Messages are decoded from fixed size
+// headers peeked out of the ring, consuming one just moves the read position, so
+// nothing is ever shifted to the front and every message costs the same no matter how
+// much is queued behind it
+class RfbInput
+{
+public:
+    enum class Status {
+        Incomplete, // the next message has not fully arrived yet
+        Ready,      // a message was decoded and consumed
+        Invalid     // unknown message type or a malformed one, the stream can't be resynchronized
+    };
+
+    // clipboard text past this is dropped on the floor as it streams in
+    static const qsizetype MAX_CUT_TEXT = 1024 * 1024;
+    // the Fence extension caps payloads here, anything longer is a broken client
+    static const int MAX_FENCE_PAYLOAD = 64;
+
+    explicit RfbInput(qsizetype capacity = 64 * 1024);
+
+    // moves whatever the device has into free ring space (two reads when it wraps).
+    // Stops when the ring is full, the rest waits in the socket until we parsed
+    qint64 readFrom(QIODevice* device);
+    qsizetype size() const { return m_size; }
+    bool isFull() const { return m_size == capacity(); }
+
+    // consumes n bytes into dst if that many are buffered, for the handshake
+    bool take(void* dst, qsizetype n);
+    // queues bytes that did not come straight from a device, growing the ring if needed
+    void append(const char* data, qsizetype n);
+
+    Status next(ClientMessage& message);
+
+private:
+    qsizetype capacity() const { return m_data.size(); }
+    void peek(void* dst, qsizetype n, qsizetype offset = 0) const;
+    void consume(qsizetype n);
+    // grows the ring so a message of n bytes fits in one piece
+    void reserve(qsizetype n);
+
+    QByteArray m_data; // capacity is always a power of two
+    qsizetype m_head = 0;
+    qsizetype m_size = 0;
+
+    // a ClientCutText body being streamed through, so long texts never sit in the ring
+    bool m_inCutText = false;
+    quint32 m_cutTextRemaining = 0;
+    QByteArray m_cutText;
+};
+
+#endif // RFBINPUT_H
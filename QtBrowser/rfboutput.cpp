@@ -0,0 +1,79 @@
+#include "rfboutput.h"
+#include <QtEndian>
+#include <cstring>
+
+void OutgoingRect::reset() {
+    // resize(0) and clear() on a list both keep the allocation in Qt 6, clear() on a
+    // byte array would not
+    buffer.resize(0);
+    segments.clear();
+    allocations = 0;
+    bytesCopied = 0;
+}
+
+char* OutgoingRect::grow(qsizetype size) {
+    const qsizetype offset = buffer.size();
+    if (buffer.capacity() < offset + size) {
+        ++allocations;
+        buffer.reserve(qMax(offset + size, buffer.capacity() * 2));
+    }
+    buffer.resize(offset + size);
+
+    IoSegment segment;
+    segment.offset = offset;
+    segment.size = size;
+    addSegment(segment);
+    return buffer.data() + offset;
+}
+
+void OutgoingRect::shrink(qsizetype size) {
+    buffer.resize(buffer.size() - size);
+    segments.last().size -= size;
+}
+
+void OutgoingRect::append(const char* data, qsizetype size) {
+    std::memcpy(grow(size), data, size);
+    bytesCopied += size;
+}
+
+void OutgoingRect::appendExternal(const char* data, qsizetype size) {
+    IoSegment segment;
+    segment.external = data;
+    segment.size = size;
+    addSegment(segment);
+}
+
+void OutgoingRect::appendRectHeader(const QRect& rect, qint32 encoding) {
+    uchar header[12];
+    qToBigEndian<quint16>(quint16(rect.x()), header);
+    qToBigEndian<quint16>(quint16(rect.y()), header + 2);
+    qToBigEndian<quint16>(quint16(rect.width()), header + 4);
+    qToBigEndian<quint16>(quint16(rect.height()), header + 6);
+    qToBigEndian<qint32>(encoding, header + 8);
+    append(reinterpret_cast<const char*>(header), sizeof(header));
+}
+
+qsizetype OutgoingRect::wireSize() const {
+    qsizetype size = 0;
+    for (const IoSegment& segment : segments)
+        size += segment.size;
+    return size;
+}
+
+void OutgoingRect::addSegment(const IoSegment& segment) {
+    // back to back buffer ranges (or contiguous frame rows) go out as one write
+    if (!segments.isEmpty()) {
+        IoSegment& last = segments.last();
+        if (!segment.external && !last.external && last.offset + last.size == segment.offset) {
+            last.size += segment.size;
+            return;
+        }
+        if (segment.external && last.external && last.external + last.size == segment.external) {
+            last.size += segment.size;
+            return;
+        }
+    }
+    if (segments.size() == segments.capacity())
+        ++allocations;
+    segments.append(segment);
+}
@@ -0,0 +1,50 @@
+#ifndef RFBOUTPUT_H
+#define RFBOUTPUT_H
+
+#include <QByteArray>
+#include <QList>
+#include <QRect>
+
+// one piece of an outgoing rectangle, either a range of the rectangles own buffer
+// or a range that points straight into frame memory
+struct IoSegment
+{
+    const char* external = nullptr; // null means the range lives in OutgoingRect::buffer
+    qsizetype offset = 0;
+    qsizetype size = 0;
+};
+
+// OutgoingRect is a reusable slot for one encoded rectangle. The session keeps a list
+// of these across updates, so once the buffers reached their working size building an
+// update stops allocating. What goes on the wire is the gather list in segments, the
+// session hands each range to the socket as is instead of first concatenating them
+struct OutgoingRect
+{
+    QByteArray buffer;
+    QList<IoSegment> segments;
+    // growth of buffer or segments while building this rectangle
+    int allocations = 0;
+    // bytes we copied into buffer, frame memory referenced by a segment is not counted
+    qsizetype bytesCopied = 0;
+
+    // empties the slot but keeps its capacity
+    void reset();
+    // appends size bytes to the buffer and returns where to write them
+    char* grow(qsizetype size);
+    // hands back the last size bytes of the latest grow() when less was written
+    void shrink(qsizetype size);
+    void append(const char* data, qsizetype size);
+    // references memory that has to stay alive until the rectangle was written
+    void appendExternal(const char* data, qsizetype size);
+    void appendRectHeader(const QRect& rect, qint32 encoding);
+
+    qsizetype wireSize() const;
+    const char* segmentData(const IoSegment& segment) const {
+        return segment.external ? segment.external : buffer.constData() + segment.offset;
+    }
+
+private:
+    void addSegment(const IoSegment& segment);
+};
+
+#endif // RFBOUTPUT_H
@@ -0,0 +1,52 @@
+#include "scrolltracker.h"
+#include <QChildEvent>
+#include <QEvent>
+#include <QWebEnginePage>
+
+ScrollTracker::ScrollTracker(QWidget* root, QObject* parent)
+    : QObject(parent),
+    m_root(root)
+{
+    if (m_root)
+        watch(m_root);
+}
+
+void ScrollTracker::watch(QWidget* widget) {
+    widget->installEventFilter(this);
+    if (QWebEngineView* view = qobject_cast<QWebEngineView*>(widget))
+        track(view);
+    const QList<QWidget*> children = widget->findChildren<QWidget*>(Qt::FindDirectChildrenOnly);
+    for (QWidget* child : children)
+        watch(child);
+}
+
+void ScrollTracker::track(QWebEngineView* view) {
+    if (m_positions.contains(view)) return;
+    m_positions.insert(view, view->page()->scrollPosition());
+    connect(view->page(), &QWebEnginePage::scrollPositionChanged, this, [this, view](const QPointF& position) {
+        onScrollPositionChanged(view, position);
+    });
+    connect(view, &QObject::destroyed, this, [this, view]() { m_positions.remove(view); });
+}
+
+bool ScrollTracker::eventFilter(QObject* watched, QEvent* event) {
+    // ChildAdded comes while the child is still being constructed, too early to tell a
+    // web view from any other widget. Polished means it is complete
+    if (event->type() == QEvent::ChildPolished) {
+        QObject* child = static_cast<QChildEvent*>(event)->child();
+        if (child->isWidgetType())
+            watch(static_cast<QWidget*>(child));
+    }
+    return QObject::eventFilter(watched, event);
+}
+
+void ScrollTracker::onScrollPositionChanged(QWebEngineView* view, const QPointF& position) {
+    const QPointF previous = m_positions.value(view, position);
+    m_positions.insert(view, position);
+    if (!m_root || !view->isVisible()) return;
+
+    // scrolling down moves the content up, and the page counts in CSS pixels
+    const QPoint delta = ((previous - position) * view->zoomFactor()).toPoint();
+    if (delta.isNull()) return;
+    emit scrolled(QRect(view->mapTo(m_root, QPoint(0, 0)), view->size()), delta);
+}
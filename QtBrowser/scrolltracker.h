@@ -0,0 +1,42 @@
+#ifndef SCROLLTRACKER_H
+#define SCROLLTRACKER_H
+
+#include <QHash>
+#include <QObject>
+#include <QPointF>
+#include <QPointer>
+#include <QRect>
+#include <QWebEngineView>
+#include <QWidget>
+
+// ScrollTracker follows the scroll position of every web view in the captured tree and
+// tells the sessions when a visible one moved its content, so they can send CopyRect
+// for the part that only moved instead of encoding the whole viewport again. Hidden
+// tabs scroll without anyone seeing it and are ignored. The deltas are only hints,
+// chromium repaints on its own schedule, the sessions check them against the pixels
+class ScrollTracker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ScrollTracker(QWidget* root, QObject* parent = nullptr);
+
+signals:
+    // GUI thread. area is the view in framebuffer coordinates, delta how far its
+    // content moved on screen, so a pixel now at p was at p - delta before
+    void scrolled(const QRect& area, const QPoint& delta);
+
+protected:
+    bool eventFilter(QObject* watched, QEvent* event) override;
+
+private:
+    void watch(QWidget* widget);
+    void track(QWebEngineView* view);
+    void onScrollPositionChanged(QWebEngineView* view, const QPointF& position);
+
+    QPointer<QWidget> m_root;
+    // last known scroll position of each view, in CSS pixels
+    QHash<QWebEngineView*, QPointF> m_positions;
+};
+
+#endif // SCROLLTRACKER_H
@@ -0,0 +1,195 @@
+#include "taskscheduler.h"
+
+static const int TASKS_PER_WORKER = 4; // enough pieces that stealing can even out uneven tiles
+
+TaskScheduler::TaskScheduler(int workerCount)
+{
+    workerCount = qMax(1, workerCount);
+    for (int i = 0; i < workerCount; ++i)
+        m_queues.append(new WorkerQueue);
+
+    for (int i = 0; i < workerCount; ++i) {
+        QThread* worker = QThread::create([this, i]() { workerLoop(i); });
+        worker->setObjectName(QString("VncEncode%1").arg(i));
+        worker->start();
+        m_workers.append(worker);
+    }
+}
+
+TaskScheduler::~TaskScheduler() {
+    {
+        QMutexLocker locker(&m_sleepMutex);
+        m_stopping = true;
+        m_wake.wakeAll();
+    }
+    for (QThread* worker : m_workers) {
+        worker->wait();
+        delete worker;
+    }
+    qDeleteAll(m_queues);
+}
+
+void TaskScheduler::parallelFor(int count, const std::function<void(int)>& fn) {
+    if (count <= 0) return;
+    if (count == 1) {
+        // not worth waking anybody up for
+        fn(0);
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->fn = &fn;
+    const int pieces = qMin(count, workerCount() * TASKS_PER_WORKER);
+    job->remaining = pieces;
+    push(job, count, pieces);
+
+    // the caller helps instead of idling, that also keeps a job moving when every
+    // worker is busy with another sessions update. It never picks up another sessions
+    // tasks though, that would hold this session's socket up for someone else's encode
+    Task task;
+    while (takeOwn(job, task)) {
+        run(task);
+        task = Task();
+    }
+
+    QMutexLocker locker(&job->mutex);
+    while (job->remaining > 0)
+        job->done.wait(&job->mutex);
+}
+
+void TaskScheduler::parallelForOrdered(int count, const std::function<void(int)>& fn,
+                                       const std::function<void(int)>& done) {
+    if (count <= 0) return;
+
+    // one index per task, a result is only as early as the piece it sits in
+    auto job = std::make_shared<Job>();
+    job->fn = &fn;
+    job->remaining = count;
+    job->finished = QList<bool>(count, false);
+    push(job, count, count);
+
+    int next = 0;
+    while (next < count) {
+        int ready = next;
+        {
+            QMutexLocker locker(&job->mutex);
+            while (ready < count && job->finished.at(ready))
+                ++ready;
+        }
+        if (ready > next) {
+            // outside the lock, the workers keep finishing while we hand results out
+            for (; next < ready; ++next)
+                done(next);
+            continue;
+        }
+
+        // the next index is still running (or queued), help out or wait for it
+        Task task;
+        if (takeOwn(job, task)) {
+            run(task);
+            continue;
+        }
+        QMutexLocker locker(&job->mutex);
+        if (!job->finished.at(next))
+            job->done.wait(&job->mutex);
+    }
+}
+
+void TaskScheduler::push(const std::shared_ptr<Job>& job, int count, int pieces) {
+    // deal the pieces out over every deque so all workers start right away,
+    // stealing only has to fix up the imbalance. Each deque is filled from its last
+    // piece down, so its owner (popping from the back) starts with the lowest indices
+    const int first = m_nextQueue.fetch_add(1, std::memory_order_relaxed);
+    for (int p = pieces - 1; p >= 0; --p) {
+        Task task;
+        task.job = job;
+        task.begin = int(qint64(count) * p / pieces);
+        task.end = int(qint64(count) * (p + 1) / pieces);
+
+        WorkerQueue* queue = m_queues.at((first + p) % m_queues.size());
+        QMutexLocker locker(&queue->mutex);
+        queue->tasks.push_back(task);
+    }
+    m_queued.fetch_add(pieces);
+    {
+        QMutexLocker locker(&m_sleepMutex);
+        m_wake.wakeAll();
+    }
+}
+
+void TaskScheduler::workerLoop(int index) {
+    Task task;
+    for (;;) {
+        if (popLocal(index, task) || steal(index, task)) {
+            run(task);
+            task = Task();
+            continue;
+        }
+
+        QMutexLocker locker(&m_sleepMutex);
+        if (m_stopping) return;
+        // pushes bump m_queued before taking the sleep mutex to wake us, so checking it
+        // under the mutex can't miss one
+        if (m_queued.load() == 0)
+            m_wake.wait(&m_sleepMutex);
+    }
+}
+
+bool TaskScheduler::popLocal(int index, Task& task) {
+    WorkerQueue* queue = m_queues.at(index);
+    QMutexLocker locker(&queue->mutex);
+    if (queue->tasks.empty()) return false;
+    task = queue->tasks.back();
+    queue->tasks.pop_back();
+    m_queued.fetch_sub(1);
+    return true;
+}
+
+bool TaskScheduler::steal(int thief, Task& task) {
+    const int count = m_queues.size();
+    const int start = thief + 1;
+    for (int i = 0; i < count; ++i) {
+        const int victim = (start + i) % count;
+        if (victim == thief) continue;
+
+        WorkerQueue* queue = m_queues.at(victim);
+        QMutexLocker locker(&queue->mutex);
+        if (queue->tasks.empty()) continue;
+        // oldest work first, it is furthest from whatever the owner is doing right now
+        task = queue->tasks.front();
+        queue->tasks.pop_front();
+        m_queued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+bool TaskScheduler::takeOwn(const std::shared_ptr<Job>& job, Task& task) {
+    for (WorkerQueue* queue : std::as_const(m_queues)) {
+        QMutexLocker locker(&queue->mutex);
+        // front first like a thief, the owner is busy at the back
+        for (auto it = queue->tasks.begin(); it != queue->tasks.end(); ++it) {
+            if (it->job != job) continue;
+            task = *it;
+            queue->tasks.erase(it);
+            m_queued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::run(const Task& task) {
+    for (int i = task.begin; i < task.end; ++i)
+        (*task.job->fn)(i);
+
+    QMutexLocker locker(&task.job->mutex);
+    const bool ordered = !task.job->finished.isEmpty();
+    if (ordered) {
+        for (int i = task.begin; i < task.end; ++i)
+            task.job->finished[i] = true;
+    }
+    // an ordered caller waits for single indices, not just for the end
+    if (--task.job->remaining == 0 || ordered)
+        task.job->done.wakeAll();
+}
@@ -0,0 +1,85 @@
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+
+// TaskScheduler is a small work stealing pool used to encode the tiles of an update on
+// every core. There is one per server and every session shares it. Each worker owns a
+// deque: it pops its own work from the back and steals from the front of the others
+// when it runs dry. A thread calling parallelFor() helps too, but only with its own
+// job, so besides the workers at most one thread per caller is encoding at any time
+class TaskScheduler
+{
+public:
+    explicit TaskScheduler(int workerCount = QThread::idealThreadCount());
+    ~TaskScheduler();
+
+    // runs fn(i) for every i in [0, count) and returns once all of them finished.
+    // The calling thread works on its own tasks too instead of just sleeping. Results
+    // should go into slots indexed by i, that keeps the output order deterministic
+    // no matter which thread ran what
+    void parallelFor(int count, const std::function<void(int)>& fn);
+    // same, but also calls done(i) on the calling thread for every index in order, as
+    // soon as that index and all before it finished. The caller spends its time in
+    // done() and only helps with fn() while the next index is still running, so the
+    // first results can be used long before the last one is ready
+    void parallelForOrdered(int count, const std::function<void(int)>& fn,
+                            const std::function<void(int)>& done);
+
+    int workerCount() const { return m_workers.size(); }
+
+private:
+    // shared by its tasks so a worker finishing the last one never touches a job the
+    // caller already dropped
+    struct Job
+    {
+        const std::function<void(int)>* fn = nullptr;
+        int remaining = 0; // tasks, not indices. Guarded by mutex
+        // per index, only for ordered jobs. Guarded by mutex
+        QList<bool> finished;
+        QMutex mutex;
+        QWaitCondition done;
+    };
+
+    // a contiguous range of indices, the unit that gets pushed and stolen
+    struct Task
+    {
+        std::shared_ptr<Job> job;
+        int begin = 0;
+        int end = 0;
+    };
+
+    struct WorkerQueue
+    {
+        QMutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // splits [0, count) into pieces and deals them over the worker queues
+    void push(const std::shared_ptr<Job>& job, int count, int pieces);
+    void workerLoop(int index);
+    bool popLocal(int index, Task& task);
+    bool steal(int thief, Task& task);
+    // takes a queued task of job from any deque, for the thread waiting on it
+    bool takeOwn(const std::shared_ptr<Job>& job, Task& task);
+    void run(const Task& task);
+
+    QList<QThread*> m_workers;
+    QList<WorkerQueue*> m_queues;
+    std::atomic<int> m_queued { 0 };
+    std::atomic<int> m_nextQueue { 0 };
+
+    // idle workers sleep here until something gets pushed
+    QMutex m_sleepMutex;
+    QWaitCondition m_wake;
+    bool m_stopping = false;
+};
+
+#endif // TASKSCHEDULER_H
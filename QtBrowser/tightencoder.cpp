@@ -0,0 +1,355 @@
+#include "tightencoder.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#else
+#include <QBuffer>
+#include <QImageWriter>
+#endif
+
+// compression control byte, the low nibble would reset streams, we never do
+static const uchar TIGHT_FILL = 0x80;
+static const uchar TIGHT_JPEG = 0x90;
+static const uchar TIGHT_EXPLICIT_FILTER = 0x40;
+
+static const uchar FILTER_PALETTE = 1;
+static const uchar FILTER_GRADIENT = 2;
+
+// which of the four streams each kind of data goes through, similar data keeps
+// similar dictionaries
+static const int STREAM_FULL_COLOUR = 0;
+static const int STREAM_MONO = 1;
+static const int STREAM_PALETTE = 2;
+static const int STREAM_GRADIENT = 3;
+
+static const int MIN_TO_COMPRESS = 12; // shorter data goes out without zlib
+static const int MAX_PALETTE = 256;
+static const int JPEG_PALETTE_LIMIT = 24; // more colours than this and JPEG wins
+static const int JPEG_MIN_PIXELS = 256;   // slivers cost more in JPEG headers than they save
+// average gradient error per channel up to which the filter pays off, anything
+// rougher compresses better unfiltered
+static const int GRADIENT_MAX_ERROR = 12;
+static const int PALETTE_SLOTS = 1024; // a power of two well above MAX_PALETTE
+static const int DEFLATE_SLACK = 64;
+
+// JPEG quality for each QualityLevel, the same scale other Tight servers use
+static const int JPEG_QUALITY[10] = { 15, 29, 41, 42, 62, 77, 79, 86, 92, 100 };
+
+// 32 bit pixels with 8 bit channels go out as three bytes, R G B whatever the shifts
+static bool isTpixelFormat(const PixelFormat& format) {
+    return format.bitsPerPixel == 32 && format.depth == 24 && format.trueColour && format.redMax == 255
+           && format.greenMax == 255 && format.blueMax == 255;
+}
+
+static uchar* putTpixel(quint32 pixel, uchar* dst) {
+    dst[0] = uchar(pixel >> 16);
+    dst[1] = uchar(pixel >> 8);
+    dst[2] = uchar(pixel);
+    return dst + 3;
+}
+
+// 1 to 3 bytes, 7 bits each, low bits first
+static int putCompactLength(qsizetype length, uchar* dst) {
+    dst[0] = uchar(length & 0x7f);
+    if (length <= 0x7f) return 1;
+    dst[0] |= 0x80;
+    dst[1] = uchar((length >> 7) & 0x7f);
+    if (length <= 0x3fff) return 2;
+    dst[1] |= 0x80;
+    dst[2] = uchar(length >> 14);
+    return 3;
+}
+
+// colour to index for one tile, open addressing on a hash of the pixel
+struct TilePalette
+{
+    quint32 colours[MAX_PALETTE];
+    int size = 0;
+    bool overflow = false;
+    quint32 keys[PALETTE_SLOTS];
+    qint16 indices[PALETTE_SLOTS];
+
+    TilePalette() { std::memset(indices, -1, sizeof(indices)); }
+
+    static int slotFor(quint32 pixel) { return int((pixel * 2654435761u) >> 22); }
+
+    int indexOf(quint32 pixel) const {
+        for (int slot = slotFor(pixel);; slot = (slot + 1) & (PALETTE_SLOTS - 1)) {
+            if (indices[slot] < 0 || keys[slot] == pixel) return indices[slot];
+        }
+    }
+
+    void insert(quint32 pixel) {
+        int slot = slotFor(pixel);
+        for (; indices[slot] >= 0; slot = (slot + 1) & (PALETTE_SLOTS - 1)) {
+            if (keys[slot] == pixel) return;
+        }
+        if (size == MAX_PALETTE) {
+            overflow = true;
+            return;
+        }
+        keys[slot] = pixel;
+        indices[slot] = qint16(size);
+        colours[size++] = pixel;
+    }
+};
+
+// the gradient filter predicts every channel from the left, upper and upper left
+// neighbours inside the rectangle (zero outside it) and sends what the guess missed by.
+// Returns the summed absolute error, dst can be null to only measure
+static qint64 gradientFilter(const quint32* pixels, qsizetype stride, int width, int height, uchar* dst) {
+    qint64 error = 0;
+    for (int y = 0; y < height; ++y) {
+        const quint32* row = pixels + y * stride;
+        const quint32* above = y ? row - stride : nullptr;
+        for (int x = 0; x < width; ++x) {
+            const quint32 left = x ? row[x - 1] : 0;
+            const quint32 up = above ? above[x] : 0;
+            const quint32 upLeft = above && x ? above[x - 1] : 0;
+            for (int shift = 16; shift >= 0; shift -= 8) {
+                const int predicted = qBound(0, int((left >> shift) & 0xff) + int((up >> shift) & 0xff)
+                                                    - int((upLeft >> shift) & 0xff), 255);
+                const int miss = int((row[x] >> shift) & 0xff) - predicted;
+                error += std::abs(miss);
+                if (dst) *dst++ = uchar(miss);
+            }
+        }
+    }
+    return error;
+}
+
+#ifdef HAVE_TURBOJPEG
+// one compressor per worker thread, created on first use
+struct JpegCompressor
+{
+    tjhandle handle = tjInitCompress();
+    ~JpegCompressor() { if (handle) tjDestroy(handle); }
+};
+#endif
+
+// the JPEG subencoding for one tile, straight from the frame. False when the codec
+// failed, out is untouched then
+static bool appendJpeg(const QImage& image, const QRect& rect, int qualityLevel, OutgoingRect& out) {
+    const int quality = JPEG_QUALITY[qualityLevel];
+    const uchar* src = image.constScanLine(rect.top()) + rect.left() * 4;
+    uchar header[4];
+    header[0] = TIGHT_JPEG;
+
+#ifdef HAVE_TURBOJPEG
+    thread_local JpegCompressor compressor;
+    if (!compressor.handle) return false;
+    // Format_RGB32 is 0xffRRGGBB as a native word
+    const int pixelFormat = Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? TJPF_BGRX : TJPF_XRGB;
+    // full chroma once the client asks for near lossless
+    const int subsampling = qualityLevel >= 8 ? TJSAMP_444 : TJSAMP_420;
+    unsigned char* jpeg = nullptr;
+    unsigned long size = 0;
+    if (tjCompress2(compressor.handle, src, rect.width(), int(image.bytesPerLine()), rect.height(), pixelFormat,
+                    &jpeg, &size, subsampling, quality, TJFLAG_FASTDCT) != 0) {
+        tjFree(jpeg);
+        return false;
+    }
+    out.append(reinterpret_cast<const char*>(header), 1 + putCompactLength(qsizetype(size), header + 1));
+    out.append(reinterpret_cast<const char*>(jpeg), qsizetype(size));
+    tjFree(jpeg);
+#else
+    // Qt's own jpeg plugin, libjpeg-turbo underneath in most builds. The QImage only
+    // wraps the frame memory
+    const QImage tile(src, rect.width(), rect.height(), image.bytesPerLine(), QImage::Format_RGB32);
+    QByteArray jpeg;
+    QBuffer buffer(&jpeg);
+    buffer.open(QIODevice::WriteOnly);
+    QImageWriter writer(&buffer, "jpeg");
+    writer.setQuality(quality);
+    if (!writer.write(tile)) return false;
+    out.append(reinterpret_cast<const char*>(header), 1 + putCompactLength(jpeg.size(), header + 1));
+    out.append(jpeg.constData(), jpeg.size());
+#endif
+    return true;
+}
+
+TightTile encodeTightRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                          int jpegQualityLevel, OutgoingRect& out) {
+    TightTile tile;
+    out.appendRectHeader(rect, ENCODING_TIGHT);
+
+    const bool tpixel = isTpixelFormat(converter.format());
+    const int pixelSize = tpixel ? 3 : converter.format().bytesPerPixel();
+    auto putPixels = [&](const quint32* src, int count, uchar* dst) {
+        if (!tpixel) {
+            converter.convert(src, dst, count);
+            return;
+        }
+        for (int i = 0; i < count; ++i)
+            dst = putTpixel(src[i], dst);
+    };
+
+    const int width = rect.width();
+    const int height = rect.height();
+    const qsizetype stride = image.bytesPerLine() / 4;
+    const quint32* pixels = reinterpret_cast<const quint32*>(image.constScanLine(rect.top())) + rect.left();
+
+    // neighbours are mostly the same colour, only a change needs a hash lookup
+    TilePalette palette;
+    quint32 previous = pixels[0];
+    palette.insert(previous);
+    for (int y = 0; y < height && !palette.overflow; ++y) {
+        const quint32* row = pixels + y * stride;
+        for (int x = 0; x < width; ++x) {
+            if (row[x] == previous) continue;
+            previous = row[x];
+            palette.insert(previous);
+        }
+    }
+
+    if (!palette.overflow && palette.size == 1) {
+        uchar* dst = reinterpret_cast<uchar*>(out.grow(1 + pixelSize));
+        out.bytesCopied += 1 + pixelSize;
+        dst[0] = TIGHT_FILL;
+        putPixels(pixels, 1, dst + 1);
+        return tile;
+    }
+
+    // JPEG needs the three channels, and lossy only ever happens when the client asked
+    const bool jpeg = tpixel && jpegQualityLevel >= 0 && width * height >= JPEG_MIN_PIXELS;
+    const int paletteLimit = jpeg ? JPEG_PALETTE_LIMIT : MAX_PALETTE;
+    qsizetype dataSize = 0;
+    if (!palette.overflow && palette.size <= paletteLimit) {
+        // two colours are one bit per pixel with every row starting on a new byte,
+        // more are one byte per pixel
+        const bool mono = palette.size == 2;
+        tile.stream = mono ? STREAM_MONO : STREAM_PALETTE;
+        dataSize = mono ? qsizetype(height) * ((width + 7) / 8) : qsizetype(width) * height;
+        const qsizetype headerSize = 3 + qsizetype(palette.size) * pixelSize;
+        uchar* dst = reinterpret_cast<uchar*>(out.grow(headerSize + dataSize));
+        out.bytesCopied += headerSize + dataSize;
+        *dst++ = uchar(TIGHT_EXPLICIT_FILTER | (tile.stream << 4));
+        *dst++ = FILTER_PALETTE;
+        *dst++ = uchar(palette.size - 1);
+        putPixels(palette.colours, palette.size, dst);
+        dst += palette.size * pixelSize;
+
+        for (int y = 0; y < height; ++y) {
+            const quint32* row = pixels + y * stride;
+            if (!mono) {
+                for (int x = 0; x < width; ++x)
+                    *dst++ = uchar(palette.indexOf(row[x]));
+                continue;
+            }
+            uint byte = 0;
+            for (int x = 0; x < width; ++x) {
+                byte = (byte << 1) | uint(row[x] != palette.colours[0]);
+                if ((x & 7) == 7) {
+                    *dst++ = uchar(byte);
+                    byte = 0;
+                }
+            }
+            if (width & 7) *dst++ = uchar(byte << (8 - (width & 7)));
+        }
+    } else if (jpeg && appendJpeg(image, rect, jpegQualityLevel, out)) {
+        return tile;
+    } else {
+        dataSize = qsizetype(width) * height * pixelSize;
+        const bool gradient = tpixel && gradientFilter(pixels, stride, width, height, nullptr)
+                                            < qint64(GRADIENT_MAX_ERROR) * width * height * 3;
+        tile.stream = gradient ? STREAM_GRADIENT : STREAM_FULL_COLOUR;
+        // the copy filter is the default, it needs no filter byte
+        const int headerSize = gradient ? 2 : 1;
+        uchar* dst = reinterpret_cast<uchar*>(out.grow(headerSize + dataSize));
+        out.bytesCopied += headerSize + dataSize;
+        *dst++ = uchar((gradient ? TIGHT_EXPLICIT_FILTER : 0) | (tile.stream << 4));
+        if (gradient) {
+            *dst++ = FILTER_GRADIENT;
+            gradientFilter(pixels, stride, width, height, dst);
+        } else {
+            for (int y = 0; y < height; ++y, dst += width * pixelSize)
+                putPixels(pixels + y * stride, width, dst);
+        }
+    }
+
+    // the data is at the end of out, short data is final as it is
+    tile.dataOffset = out.buffer.size() - dataSize;
+    if (dataSize < MIN_TO_COMPRESS) tile.stream = -1;
+    return tile;
+}
+
+TightStreams::TightStreams() {
+    for (int i = 0; i < STREAM_COUNT; ++i) {
+        std::memset(&m_streams[i], 0, sizeof(z_stream));
+        m_ready[i] = false;
+        m_failed[i] = false;
+        m_streamLevels[i] = -1;
+    }
+}
+
+TightStreams::~TightStreams() {
+    for (int i = 0; i < STREAM_COUNT; ++i) {
+        if (m_ready[i]) deflateEnd(&m_streams[i]);
+    }
+}
+
+qint64 TightStreams::takeDeflateNsecs() {
+    const qint64 nsecs = m_deflateNsecs;
+    m_deflateNsecs = 0;
+    return nsecs;
+}
+
+bool TightStreams::deflateTile(const TightTile& tile, const OutgoingRect& in, OutgoingRect& out) {
+    z_stream& stream = m_streams[tile.stream];
+    // streams start on first use, a session that never sends a palette never has one
+    if (!m_ready[tile.stream]) {
+        if (m_failed[tile.stream]) return false;
+        m_ready[tile.stream] = deflateInit(&stream, m_level) == Z_OK;
+        m_streamLevels[tile.stream] = m_level;
+        if (!m_ready[tile.stream]) {
+            qWarning() << "[Server] zlib init failed:" << (stream.msg ? stream.msg : "")
+                       << "tiles for Tight stream" << tile.stream << "go out raw";
+            m_failed[tile.stream] = true;
+            return false;
+        }
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    out.append(in.buffer.constData(), tile.dataOffset);
+
+    const qsizetype size = in.buffer.size() - tile.dataOffset;
+    m_compressed.resize(qsizetype(deflateBound(&stream, uLong(size))) + DEFLATE_SLACK);
+    stream.next_out = reinterpret_cast<Bytef*>(m_compressed.data());
+    stream.avail_out = uInt(m_compressed.size());
+    // before the tile goes in, deflateParams() flushes whatever input it still has with
+    // the old level and would eat into this tile otherwise. What it flushes lands in
+    // m_compressed ahead of the tile. Z_BUF_ERROR means it could not finish, the old
+    // level stays and the next tile tries again
+    if (m_streamLevels[tile.stream] != m_level) {
+        stream.avail_in = 0;
+        const int result = deflateParams(&stream, m_level, Z_DEFAULT_STRATEGY);
+        if (result == Z_OK)
+            m_streamLevels[tile.stream] = m_level;
+        else if (result != Z_BUF_ERROR)
+            qWarning() << "[Server] zlib deflateParams failed:" << result;
+    }
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.buffer.constData() + tile.dataOffset));
+    stream.avail_in = uInt(size);
+
+    // a sync flush ends on a byte boundary with everything so far decodable
+    qsizetype used = 0;
+    while (true) {
+        deflate(&stream, Z_SYNC_FLUSH);
+        used = m_compressed.size() - stream.avail_out;
+        if (stream.avail_out) break;
+        m_compressed.resize(m_compressed.size() * 2);
+        stream.next_out = reinterpret_cast<Bytef*>(m_compressed.data() + used);
+        stream.avail_out = uInt(m_compressed.size() - used);
+    }
+
+    uchar length[3];
+    out.append(reinterpret_cast<const char*>(length), putCompactLength(used, length));
+    out.append(m_compressed.constData(), used);
+    m_deflateNsecs += timer.nsecsElapsed();
+    return true;
+}
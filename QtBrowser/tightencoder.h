@@ -0,0 +1,67 @@
+#ifndef TIGHTENCODER_H
+#define TIGHTENCODER_H
+
+#include <QImage>
+#include <QRect>
+#include <zlib.h>
+#include "pixelformat.h"
+#include "rfboutput.h"
+
+static const qint32 ENCODING_TIGHT = 7;
+// QualityLevel pseudo encodings, -32 is JPEG quality level 0 up to -23 for level 9
+static const qint32 ENCODING_QUALITY_LEVEL_0 = -32;
+static const qint32 ENCODING_QUALITY_LEVEL_9 = -23;
+
+// where a Tight tile stands after encodeTightRect(): stream is the zlib stream the
+// bytes from dataOffset on still have to go through, or -1 when out is final already
+// (fill, JPEG, or data too short to be worth compressing)
+struct TightTile
+{
+    int stream = -1;
+    qsizetype dataOffset = 0;
+};
+
+// one rectangle of a Format_RGB32 frame as Tight (encoding 7): fill for a single
+// colour, a palette for up to a few dozen colours (one bit per pixel for two), JPEG for
+// photos when jpegQualityLevel is 0 to 9, else full colour with the gradient filter on
+// smooth content. Thread safe, the workers call it for their tiles at once and the
+// session runs the zlib part in wire order
+TightTile encodeTightRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                          int jpegQualityLevel, OutgoingRect& out);
+
+// TightStreams are the four zlib streams of a Tight connection. Like ZRLE's they
+// live as long as the session, each tile goes through the one its filter maps to.
+// Session thread only
+class TightStreams
+{
+public:
+    TightStreams();
+    ~TightStreams();
+    TightStreams(const TightStreams&) = delete;
+    TightStreams& operator=(const TightStreams&) = delete;
+
+    // 0 to 9, applied to each stream the next time it is used
+    void setLevel(int level) { m_level = level; }
+
+    // the finished rectangle: tile's bytes up to dataOffset as they are, then the
+    // compact length and the deflated rest. Returns false and leaves out alone when
+    // the tile's stream could not be set up, the rectangle has to go out in another
+    // encoding
+    bool deflateTile(const TightTile& tile, const OutgoingRect& in, OutgoingRect& out);
+
+    // time spent in zlib since the last call
+    qint64 takeDeflateNsecs();
+
+private:
+    static const int STREAM_COUNT = 4;
+
+    z_stream m_streams[STREAM_COUNT];
+    int m_streamLevels[STREAM_COUNT];
+    bool m_ready[STREAM_COUNT];
+    bool m_failed[STREAM_COUNT]; // deflateInit() failed once, not tried again
+    int m_level = 6; // zlib's own default
+    QByteArray m_compressed;
+    qint64 m_deflateNsecs = 0;
+};
+
+#endif // TIGHTENCODER_H
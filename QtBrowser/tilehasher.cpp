@@ -0,0 +1,240 @@
+#include "tilehasher.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TILEHASH_SSE2
+#endif
+
+// the hash is an xxh3 style accumulate: every 16 byte block is xored with a key that
+// advances per block, the two 32 bit halves of each lane are multiplied together and
+// the swapped input is added back in so a zero product can't erase the data. Keys
+// depend on the position inside the tile, so moving content around changes the hash
+static const quint64 KEY_LO = 0xbe4ba423396cfeb8ULL;
+static const quint64 KEY_HI = 0x1cad21f72c81017cULL;
+static const quint64 KEY_STEP_LO = 0x9E3779B185EBCA87ULL;
+static const quint64 KEY_STEP_HI = 0xC2B2AE3D27D4EB4FULL;
+
+static inline quint64 rotl64(quint64 v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+// murmur3 finalizer, spreads the accumulators over all 64 bits
+static inline quint64 avalanche(quint64 h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// scalar version, same math one lane at a time. Always built so the benchmark has
+// something to hold the vector one against
+static quint64 hashTileScalar(const uchar* bits, qsizetype bytesPerLine, int widthBytes, int rows) {
+    quint64 acc[2] = { 0, 0 };
+    quint64 key[2] = { KEY_LO, KEY_HI };
+
+    auto accumulate = [&](const uchar* block) {
+        quint64 data[2];
+        std::memcpy(data, block, 16);
+        for (int lane = 0; lane < 2; ++lane) {
+            const quint64 mixed = data[lane] ^ key[lane];
+            acc[lane] += (mixed & 0xffffffffULL) * (mixed >> 32) + data[lane ^ 1];
+        }
+        key[0] += KEY_STEP_LO;
+        key[1] += KEY_STEP_HI;
+    };
+
+    const int blocks = widthBytes / 16;
+    const int tail = widthBytes % 16;
+    for (int y = 0; y < rows; ++y) {
+        const uchar* row = bits + y * bytesPerLine;
+        for (int i = 0; i < blocks; ++i)
+            accumulate(row + i * 16);
+        if (tail) {
+            uchar last[16] = {};
+            std::memcpy(last, row + blocks * 16, tail);
+            accumulate(last);
+        }
+    }
+
+    return avalanche(acc[0] ^ rotl64(acc[1], 29) ^ (quint64(rows) << 32) ^ quint64(widthBytes));
+}
+
+#ifdef TILEHASH_SSE2
+
+static inline __m128i accumulateBlock(__m128i acc, __m128i data, __m128i key) {
+    const __m128i mixed = _mm_xor_si128(data, key);
+    const __m128i high = _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1));
+    const __m128i product = _mm_mul_epu32(mixed, high);
+    const __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm_add_epi64(acc, _mm_add_epi64(product, swapped));
+}
+
+static quint64 hashTileSse2(const uchar* bits, qsizetype bytesPerLine, int widthBytes, int rows) {
+    __m128i acc = _mm_setzero_si128();
+    __m128i key = _mm_set_epi64x(qint64(KEY_HI), qint64(KEY_LO));
+    const __m128i step = _mm_set_epi64x(qint64(KEY_STEP_HI), qint64(KEY_STEP_LO));
+    const int blocks = widthBytes / 16;
+    const int tail = widthBytes % 16;
+
+    for (int y = 0; y < rows; ++y) {
+        const uchar* row = bits + y * bytesPerLine;
+        for (int i = 0; i < blocks; ++i) {
+            const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i * 16));
+            acc = accumulateBlock(acc, data, key);
+            key = _mm_add_epi64(key, step);
+        }
+        if (tail) {
+            alignas(16) uchar last[16] = {};
+            std::memcpy(last, row + blocks * 16, tail);
+            acc = accumulateBlock(acc, _mm_load_si128(reinterpret_cast<const __m128i*>(last)), key);
+            key = _mm_add_epi64(key, step);
+        }
+    }
+
+    alignas(16) quint64 lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    return avalanche(lanes[0] ^ rotl64(lanes[1], 29) ^ (quint64(rows) << 32) ^ quint64(widthBytes));
+}
+
+#endif
+
+quint64 TileHasher::hashTile(const uchar* bits, qsizetype bytesPerLine, int widthBytes, int rows) {
+#ifdef TILEHASH_SSE2
+    return hashTileSse2(bits, bytesPerLine, widthBytes, rows);
+#else
+    return hashTileScalar(bits, bytesPerLine, widthBytes, rows);
+#endif
+}
+
+void TileHasher::reset() {
+    m_size = QSize();
+    m_columns = 0;
+    m_hashes.clear();
+    m_visited.clear();
+    m_generation = 0;
+}
+
+double TileHasher::nsecsPerMegapixel() const {
+    if (m_pixelsHashed == 0) return 0.0;
+    return double(m_hashNsecs) * 1000000.0 / double(m_pixelsHashed);
+}
+
+QRegion TileHasher::changedTiles(const QImage& image, const QRegion& candidates) {
+    Q_ASSERT(image.depth() == 32);
+    const QRect bounds = image.rect();
+    if (bounds.isEmpty()) return QRegion();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (image.size() != m_size) {
+        // nothing we stored describes this frame anymore
+        reset();
+        m_size = image.size();
+        m_columns = (m_size.width() + TILE_SIZE - 1) / TILE_SIZE;
+        const int tileRows = (m_size.height() + TILE_SIZE - 1) / TILE_SIZE;
+        m_hashes.fill(0, m_columns * tileRows);
+        m_visited.fill(0, m_columns * tileRows);
+        for (int ty = 0; ty < tileRows; ++ty) {
+            for (int tx = 0; tx < m_columns; ++tx) {
+                const QRect tile = QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE) & bounds;
+                m_hashes[ty * m_columns + tx] = hashTile(image.constScanLine(tile.y()) + tile.x() * 4,
+                                                         image.bytesPerLine(), tile.width() * 4, tile.height());
+            }
+        }
+        // the most expensive call there is, the throughput numbers have to see it
+        m_pixelsHashed += qint64(m_size.width()) * m_size.height();
+        m_hashNsecs += timer.nsecsElapsed();
+        return bounds;
+    }
+
+    // a tile can sit under several candidate rects, the generation stamp makes sure
+    // each one is hashed once per call without clearing a table every time
+    if (++m_generation == 0) {
+        m_visited.fill(0);
+        m_generation = 1;
+    }
+
+    QRegion changed;
+    qint64 pixels = 0;
+    for (const QRect& rect : candidates) {
+        const QRect r = rect & bounds;
+        if (r.isEmpty()) continue;
+
+        for (int ty = r.top() / TILE_SIZE; ty <= r.bottom() / TILE_SIZE; ++ty) {
+            for (int tx = r.left() / TILE_SIZE; tx <= r.right() / TILE_SIZE; ++tx) {
+                const int index = ty * m_columns + tx;
+                if (m_visited[index] == m_generation) continue;
+                m_visited[index] = m_generation;
+
+                const QRect tile = QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE) & bounds;
+                const quint64 hash = hashTile(image.constScanLine(tile.y()) + tile.x() * 4,
+                                              image.bytesPerLine(), tile.width() * 4, tile.height());
+                pixels += qint64(tile.width()) * tile.height();
+                if (hash != m_hashes[index]) {
+                    m_hashes[index] = hash;
+                    changed += tile;
+                }
+            }
+        }
+    }
+
+    m_pixelsHashed += pixels;
+    m_hashNsecs += timer.nsecsElapsed();
+    return changed;
+}
+
+void TileHasher::benchmark() {
+    const int width = 1920;
+    const int height = 1080;
+    const int rounds = 50;
+
+    QVector<quint32> frame(width * height);
+    quint32 seed = 0x12345678;
+    for (quint32& pixel : frame) {
+        seed = seed * 1664525u + 1013904223u;
+        pixel = 0xff000000u | (seed >> 8);
+    }
+    const uchar* bits = reinterpret_cast<const uchar*>(frame.constData());
+    const qsizetype bytesPerLine = width * 4;
+
+    using Kernel = quint64 (*)(const uchar*, qsizetype, int, int);
+    struct Variant { const char* name; Kernel kernel; };
+    QVector<Variant> variants;
+    variants.append({ "scalar", hashTileScalar });
+#ifdef TILEHASH_SSE2
+    variants.append({ "sse2", hashTileSse2 });
+#endif
+
+    // hashed tile by tile like changedTiles() does, including the short ones on the
+    // right and bottom edge. The xor of all hashes keeps the work from being dropped
+    // and has to agree between the variants
+    QVector<quint64> sums;
+    for (const Variant& variant : variants) {
+        quint64 sum = 0;
+        QElapsedTimer timer;
+        timer.start();
+        for (int round = 0; round < rounds; ++round) {
+            for (int y = 0; y < height; y += TILE_SIZE) {
+                for (int x = 0; x < width; x += TILE_SIZE) {
+                    sum ^= variant.kernel(bits + y * bytesPerLine + x * 4, bytesPerLine,
+                                          qMin(TILE_SIZE, width - x) * 4, qMin(TILE_SIZE, height - y));
+                }
+            }
+        }
+        const double seconds = qMax<qint64>(1, timer.nsecsElapsed()) / 1e9;
+        const double gigabytes = double(frame.size()) * 4 * rounds / 1e9;
+        qDebug().nospace() << "[Server] tile hash " << variant.name << " " << width << "x" << height << ": "
+                           << gigabytes / seconds << " GB/s";
+        sums.append(sum);
+    }
+    for (quint64 sum : sums) {
+        if (sum != sums.first())
+            qWarning() << "[Server] tile hash variants disagree, the vector kernel is broken";
+    }
+}
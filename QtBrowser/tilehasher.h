@@ -0,0 +1,47 @@
+#ifndef TILEHASHER_H
+#define TILEHASHER_H
+
+#include <QImage>
+#include <QRegion>
+#include <QVector>
+
+// TileHasher cuts a frame into fixed size tiles and keeps a 64 bit hash per tile.
+// Comparing against the previous table tells us which tiles really changed, paint
+// events alone are too coarse (a blinking caret repaints the whole line edit and
+// chromium likes to repaint far more than it actually touched)
+class TileHasher
+{
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    // frames are expected to be 32 bits per pixel.
+    // hashes every tile that intersects candidates and returns the tiles whose hash
+    // differs from the stored table (tile aligned, clipped to the image). A size change
+    // throws the table away and reports the whole image
+    QRegion changedTiles(const QImage& image, const QRegion& candidates);
+    void reset();
+
+    // running totals so hash throughput can be watched on real frames
+    qint64 pixelsHashed() const { return m_pixelsHashed; }
+    qint64 hashNsecs() const { return m_hashNsecs; }
+    double nsecsPerMegapixel() const;
+
+    // hash of a block of rows, widthBytes does not need to be a multiple of 16
+    static quint64 hashTile(const uchar* bits, qsizetype bytesPerLine, int widthBytes, int rows);
+
+    // hashes a fixed 1080p frame in tiles with every kernel built in and logs GB/s.
+    // Run by --benchmark-tile-hash
+    static void benchmark();
+
+private:
+    QSize m_size;
+    int m_columns = 0;
+    QVector<quint64> m_hashes;
+    QVector<quint32> m_visited;
+    quint32 m_generation = 0;
+
+    qint64 m_pixelsHashed = 0;
+    qint64 m_hashNsecs = 0;
+};
+
+#endif // TILEHASHER_H
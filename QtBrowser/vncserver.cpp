@@ -1,61 +1,760 @@
 #include "vncserver.h"
 #include <QDataStream>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QLoggingCategory>
 #include <QTimer>
-#include <QPixmap>
 #include <QImage>
 #include <QKeyEvent>
 #include <QMouseEvent>
-#include <QCoreApplication>
-#include <QPainter>
-#include <QtOpenGLWidgets/QtOpenGLWidgets>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
 
 static const QByteArray PROTOCOL_VERSION = "RFB 003.008\n"; // must be exactly 12 bytes
+static const int MAX_UPDATE_RECTS = 64;   // past this many rectangles the header overhead isnt worth it
+static const int MAX_IO_THREADS = 4;      // sessions mostly wait on sockets, a few threads go a long way
+static const qint64 SEND_BUDGET_BYTES = 4 * 1024 * 1024; // unsent bytes a session may have queued in its socket
+static const int ENCODE_TILE_SIZE = 64;   // unit of parallel encoding, also the largest rectangle we send
+static const qint32 ENCODING_COPY_RECT = 1;
+static const int MAX_SCROLL_HINTS = 8;     // scrolls kept around until a frame shows them
+static const int SCROLL_SAMPLE_ROWS = 8;   // rows compared per candidate before a full check
+static const int MIN_COPY_ROWS = 8;        // shorter bands cost more in headers than they save
+static const qint32 ENCODING_CURSOR = -239; // pseudo encoding, the client draws the pointer shape we send
+static const qint32 ENCODING_DESKTOP_SIZE = -223;
+static const qint32 ENCODING_EXTENDED_DESKTOP_SIZE = -308;
+static const int MAX_DESKTOP_SIZE = 8192; // per side, past this a SetDesktopSize is refused
+static const int RESIZE_SETTLE_MS = 250;   // for the window manager to apply (or clamp) a resize
+static const int RESIZE_TIMEOUT_MS = 3000; // longest a SetDesktopSize waits for its snapshot
+static const qint32 ENCODING_LAST_RECT = -224;
+static const quint16 LAST_RECT_COUNT = 0xffff; // rectangle count meaning "until a LastRect"
+static const qint32 ENCODING_FENCE = -312;
+static const qint32 ENCODING_CONTINUOUS_UPDATES = -313;
+static const quint8 END_OF_CONTINUOUS_UPDATES = 150; // server message, also how we say we support them
+static const quint8 SERVER_FENCE = 248;
+// Fence flags. Every message is handled in order on the session thread, so the only
+// thing that can run late is input, which goes through the GUI thread
+static const quint32 FENCE_BLOCK_BEFORE = 0x1;
+static const quint32 FENCE_BLOCK_AFTER = 0x2;
+static const quint32 FENCE_SYNC_NEXT = 0x4;
+static const quint32 FENCE_SUPPORTED = FENCE_BLOCK_BEFORE | FENCE_BLOCK_AFTER | FENCE_SYNC_NEXT;
+static const quint32 FENCE_REQUEST = 0x80000000;
+// ExtendedDesktopSize status codes
+static const quint16 RESIZE_PROHIBITED = 1;
+static const quint16 RESIZE_OUT_OF_RESOURCES = 2;
+static const quint16 RESIZE_INVALID_LAYOUT = 3;
+
+// a line per update and per input is far too much for stderr, sessions log a summary
+// every SUMMARY_UPDATES updates instead. QT_LOGGING_RULES="vnc.updates.debug=true"
+// brings the detail back
+Q_LOGGING_CATEGORY(lcUpdates, "vnc.updates", QtInfoMsg)
+static const int SUMMARY_UPDATES = 100;
+
+static int ioThreadCount() {
+    return qBound(1, QThread::idealThreadCount(), MAX_IO_THREADS);
+}
+
+// cuts rectangles into tiles of at most ENCODE_TILE_SIZE squared, row by row so the
+// order is stable
+static void splitIntoTiles(const QList<QRect>& rects, QList<QRect>& tiles) {
+    tiles.clear();
+    for (const QRect& rect : rects) {
+        for (int y = rect.top(); y <= rect.bottom(); y += ENCODE_TILE_SIZE) {
+            for (int x = rect.left(); x <= rect.right(); x += ENCODE_TILE_SIZE) {
+                tiles.append(QRect(x, y, qMin(ENCODE_TILE_SIZE, rect.right() - x + 1),
+                                   qMin(ENCODE_TILE_SIZE, rect.bottom() - y + 1)));
+            }
+        }
+    }
+}
+
+// encoding type 0 = raw. In our native format only the header is copied, the pixel
+// rows are referenced straight out of the frame and go to the socket from there.
+// Any other format is converted row by row right into the slot buffer
+static void encodeRawRect(const QImage& image, const QRect& rect, const PixelConverter& converter,
+                          OutgoingRect& out) {
+    out.appendRectHeader(rect, 0);
+    if (converter.isIdentity()) {
+        const int rowBytes = rect.width() * 4;
+        for (int y = rect.top(); y <= rect.bottom(); ++y) {
+            const uchar* row = image.constScanLine(y) + rect.x() * 4;
+            out.appendExternal(reinterpret_cast<const char*>(row), rowBytes);
+        }
+        return;
+    }
+
+    const int rowBytes = rect.width() * converter.format().bytesPerPixel();
+    uchar* dst = reinterpret_cast<uchar*>(out.grow(qsizetype(rowBytes) * rect.height()));
+    for (int y = rect.top(); y <= rect.bottom(); ++y, dst += rowBytes) {
+        const quint32* row = reinterpret_cast<const quint32*>(image.constScanLine(y)) + rect.x();
+        converter.convert(row, dst, rect.width());
+    }
+    out.bytesCopied += qsizetype(rowBytes) * rect.height();
+}
+
+// the Cursor pseudo encoding: the rectangle is the hot spot and the size, then the
+// pixels in the client's format and a 1 bit mask, rows padded to whole bytes, MSB first
+static void encodeCursorRect(const CursorShape& cursor, const PixelConverter& converter, OutgoingRect& out) {
+    const QImage& image = cursor.image;
+    const int width = image.width();
+    const int height = image.height();
+    out.appendRectHeader(QRect(cursor.hotSpot, image.size()), ENCODING_CURSOR);
+
+    const int bytesPerPixel = converter.format().bytesPerPixel();
+    uchar* dst = reinterpret_cast<uchar*>(out.grow(qsizetype(width) * height * bytesPerPixel));
+    for (int y = 0; y < height; ++y, dst += width * bytesPerPixel) {
+        const quint32* row = reinterpret_cast<const quint32*>(image.constScanLine(y));
+        if (converter.isIdentity())
+            std::memcpy(dst, row, width * 4); // the alpha byte sits where the format has padding
+        else
+            converter.convert(row, dst, width);
+    }
+
+    const int maskStride = (width + 7) / 8;
+    uchar* mask = reinterpret_cast<uchar*>(out.grow(qsizetype(maskStride) * height));
+    std::memset(mask, 0, maskStride * height);
+    for (int y = 0; y < height; ++y, mask += maskStride) {
+        const QRgb* row = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+        for (int x = 0; x < width; ++x) {
+            if (qAlpha(row[x]) >= 128)
+                mask[x / 8] |= 0x80 >> (x % 8);
+        }
+    }
+    out.bytesCopied += qsizetype(width) * height * bytesPerPixel + qsizetype(maskStride) * height;
+}
 
 VncServer::VncServer(QWidget* view, QObject* parent)
-    : QTcpServer(parent), m_view(view)
+    : QTcpServer(parent),
+    m_view(view),
+    m_frameSource(new FrameSource(view, this)),
+    m_inputInjector(new InputInjector(view, this)),
+    m_cursorSource(new CursorSource(view, this)),
+    m_scrollTracker(new ScrollTracker(view, this)),
+    // every I/O thread can be encoding its own session's tiles next to the workers, so
+    // the workers get the cores the I/O threads don't. At least one, so a machine with
+    // no more cores than I/O threads runs one thread over
+    m_encodeScheduler(qMax(1, QThread::idealThreadCount() - ioThreadCount())),
+    m_minFps(FramePacer::DEFAULT_MIN_FPS),
+    m_maxFps(FramePacer::DEFAULT_MAX_FPS)
 {
+    qRegisterMetaType<FramePtr>("FramePtr");
+    qRegisterMetaType<CursorPtr>("CursorPtr");
+    // the cursor only has to be looked up again once the pointer actually moved
+    connect(m_inputInjector, &InputInjector::pointerMoved, m_cursorSource, &CursorSource::setPointerPosition);
+
+    const int threadCount = ioThreadCount();
+    for (int i = 0; i < threadCount; ++i) {
+        QThread* thread = new QThread(this);
+        thread->setObjectName(QString("VncIo%1").arg(i));
+        thread->start();
+        m_ioThreads.append(thread);
+    }
+}
+
+VncServer::~VncServer() {
+    // sessions are deleted on their own threads once those event loops stop, this has
+    // to happen before the frame source they point at goes away
+    for (QThread* thread : m_ioThreads)
+        thread->quit();
+    for (QThread* thread : m_ioThreads)
+        thread->wait();
+}
+
+void VncServer::setFrameRateLimits(double minFps, double maxFps) {
+    m_minFps = minFps;
+    m_maxFps = maxFps;
+    m_frameSource->setMaxFps(maxFps);
+}
+
+void VncServer::resizeDesktop(const QSize& size) {
+    // the view may sit inside the browser chrome, so the window changes by the difference
+    QWidget* window = m_view->window();
+    window->resize(window->size() + (size - m_view->size()));
+    qDebug() << "[Server] client asked for a desktop of" << size << "window now" << window->size();
 }
 
 void VncServer::incomingConnection(qintptr socketDescriptor) {
     qDebug() << "New Connection, socket descriptor:" << socketDescriptor;
-    VncSession* session = new VncSession(socketDescriptor, m_view, this);
-    session->start();
+    QThread* thread = m_ioThreads.at(m_nextIoThread++ % m_ioThreads.size());
+
+    VncSession* session = new VncSession(socketDescriptor, m_frameSource, m_inputInjector, m_cursorSource,
+                                         m_scrollTracker, &m_encodeScheduler);
+    session->setFrameRateLimits(m_minFps, m_maxFps);
+    session->setSimulatedLatency(m_simulatedLatencyMs);
+    connect(session, &VncSession::desktopSizeRequested, this, &VncServer::resizeDesktop);
+    session->moveToThread(thread);
+    connect(thread, &QThread::finished, session, &QObject::deleteLater);
+    QMetaObject::invokeMethod(session, &VncSession::start, Qt::QueuedConnection);
 }
 
-VncSession::VncSession(qintptr socketDescriptor, QWidget* view, QObject* parent)
+VncSession::VncSession(qintptr socketDescriptor, FrameSource* frameSource, InputInjector* inputInjector,
+                       CursorSource* cursorSource, ScrollTracker* scrollTracker, TaskScheduler* scheduler,
+                       QObject* parent)
     : QObject(parent),
-    m_socket(new QTcpSocket(this)),
-    m_view(view),
-    m_handshakeDone(false)
+    m_socketDescriptor(socketDescriptor),
+    m_frameSource(frameSource),
+    m_inputInjector(inputInjector),
+    m_cursorSource(cursorSource),
+    m_scrollTracker(scrollTracker),
+    m_scheduler(scheduler),
+    m_handshakeDone(false),
+    m_resizeTimer(new QTimer(this)),
+    m_paceTimer(new QTimer(this)), // a child, so it follows the session to its thread
+    m_latencyTimer(new QTimer(this)),
+    m_outputLatencyTimer(new QTimer(this))
 {
-    if(!m_socket->setSocketDescriptor(socketDescriptor)) {
+    m_paceTimer->setSingleShot(true);
+    connect(m_paceTimer, &QTimer::timeout, this, &VncSession::serviceRequest);
+    m_resizeTimer->setSingleShot(true);
+    connect(m_resizeTimer, &QTimer::timeout, this, &VncSession::onResizeTimer);
+    m_latencyTimer->setSingleShot(true);
+    m_latencyTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_latencyTimer, &QTimer::timeout, this, &VncSession::onDelayedInput);
+    m_outputLatencyTimer->setSingleShot(true);
+    m_outputLatencyTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_outputLatencyTimer, &QTimer::timeout, this, &VncSession::onDelayedOutput);
+    connect(m_inputInjector, &InputInjector::synced, this, &VncSession::onInputSynced);
+    // queued onto our I/O thread, the snapshot itself is shared not copied
+    connect(m_frameSource, &FrameSource::frameReady, this, &VncSession::onFrameReady);
+    connect(m_cursorSource, &CursorSource::cursorChanged, this, &VncSession::onCursorChanged);
+    connect(m_scrollTracker, &ScrollTracker::scrolled, this, &VncSession::onScrolled);
+}
+
+void VncSession::start() {
+    m_socket = new QTcpSocket(this);
+    if(!m_socket->setSocketDescriptor(m_socketDescriptor)) {
         qWarning() << "Failed to set socket descriptor:" << m_socket->errorString();
     }
 
     connect(m_socket, &QTcpSocket::readyRead, this, &VncSession::onReadyRead);
     connect(m_socket, &QTcpSocket::disconnected, this, &VncSession::onDisconnected);
+    connect(m_socket, &QTcpSocket::bytesWritten, this, &VncSession::onBytesWritten);
 
-    m_updateTimer.setInterval(1000);
-    connect(&m_updateTimer, &QTimer::timeout, this, &VncSession::sendFramebufferUpdate);
+    qDebug() << "Starting handshake, sending protocol version:" << PROTOCOL_VERSION;
+    send(PROTOCOL_VERSION);
+    m_socket->flush();
 }
 
-void VncSession::start() {
-    qDebug() << "Starting handshake, sending protocol version:" << PROTOCOL_VERSION;
-    m_socket->write(PROTOCOL_VERSION);
+void VncSession::onFrameReady(const FramePtr& frame) {
+    m_latestFrame = frame;
+    if (!m_handshakeDone) return;
+    followFrameSize();
+
+    // while the socket is backed up this frame simply supersedes the previous one,
+    // its damage merges into the pending region instead of queueing another update
+    if (m_congested && !frame->damage.isEmpty())
+        ++m_framesMerged;
+    if (!frame->damage.isEmpty()) {
+        m_pacer.damageArrived();
+        if (m_sinceInput.isValid()) {
+            m_inputLatencyMs = m_sinceInput.nsecsElapsed() / 1000000.0;
+            m_maxInputLatencyMs = qMax(m_maxInputLatencyMs, m_inputLatencyMs);
+            m_sinceInput.invalidate();
+            qCDebug(lcUpdates) << "[Server] input to damage ms:" << m_inputLatencyMs << "worst:" << m_maxInputLatencyMs;
+        }
+    }
+    m_damage += frame->damage;
+    serviceRequest();
+}
+
+void VncSession::onCursorChanged(const CursorPtr& cursor) {
+    m_cursor = cursor;
+    if (!m_cursorEncoding) return;
+    m_cursorDirty = true;
+    serviceRequest();
+}
+
+void VncSession::onScrolled(const QRect& area, const QPoint& delta) {
+    if (!m_copyRectEncoding) return;
+    m_scrollHints.append({ area, delta });
+    if (m_scrollHints.size() > MAX_SCROLL_HINTS)
+        m_scrollHints.removeFirst();
+}
+
+void VncSession::followFrameSize() {
+    if (!m_latestFrame || !(m_desktopSizeEncoding || m_extendedDesktopSizeEncoding)) return;
+    const QSize size = m_latestFrame->image.size();
+    if (size == m_screenSize) return;
+
+    m_screenSize = size;
+    if (m_resizeRequested && size == m_requestedSize) {
+        // exactly what this client asked for
+        m_sizeReason = 1;
+        m_sizeStatus = 0;
+        m_resizeRequested = false;
+        m_resizeTimer->stop();
+    } else if (!m_announceSize || m_sizeReason == 0) {
+        // someone else's doing, an answer already waiting goes out with the new size
+        m_sizeReason = 0;
+        m_sizeStatus = 0;
+    }
+    m_announceSize = true;
+    // nothing the client has survives the resize, and old requests are in old coordinates
+    m_damage = QRect(QPoint(0, 0), size);
+    m_forcedRegion = QRegion();
+}
+
+void VncSession::serviceRequest() {
+    // RFB is pull based, damage the client has not asked for just waits for the next request
+    if (wantedRegion().isEmpty() || m_congested || m_paceTimer->isActive()) return;
+
+    // too soon after the last update for how fast this client and page are going. The
+    // frame request waits too, so when every session is holding back nothing gets
+    // captured either
+    const int delayMs = m_pacer.delayBeforeNextUpdate();
+    if (delayMs > 0) {
+        m_paceTimer->start(delayMs);
+        return;
+    }
+    const bool sent = sendFramebufferUpdate();
+    // with continuous updates nobody asks for the next frame, so we do. A fence behind
+    // the update tells us when the client got it, that RTT feeds the pacer
+    if (sent && m_continuousUpdates && m_fenceEncoding && !m_fenceInFlight) {
+        sendFence(FENCE_REQUEST | FENCE_BLOCK_BEFORE, QByteArray());
+        m_fenceInFlight = true;
+        m_sinceFence.start();
+    }
+    if (!sent || m_continuousUpdates)
+        m_frameSource->requestFrame();
+}
+
+QRegion VncSession::wantedRegion() const {
+    return m_continuousUpdates ? m_requestedRegion | m_continuousRegion : m_requestedRegion;
+}
+
+// row y of now against the row it would be copied from in before
+static bool rowMatches(const QImage& now, const QImage& before, int y, int left, int width, const QPoint& delta) {
+    const quint32* row = reinterpret_cast<const quint32*>(now.constScanLine(y)) + left;
+    const quint32* source = reinterpret_cast<const quint32*>(before.constScanLine(y - delta.y())) + left - delta.x();
+    return std::memcmp(row, source, size_t(width) * 4) == 0;
+}
+
+QList<QRect> VncSession::findScrollCopies(QRegion& damage, QPoint& delta) {
+    QList<QRect> copies;
+    if (!m_clientFrame || m_scrollHints.isEmpty()) return copies;
+    const QImage& now = m_latestFrame->image;
+    const QImage& before = m_clientFrame->image;
+    if (now.size() != before.size()) return copies;
+
+    // chromium paints on its own schedule, so the snapshot may show any number of the
+    // hinted scrolls past the client's one. Every run of consecutive hints is a
+    // candidate, a few sampled rows pick the likeliest and only that one is checked in full
+    const QRect bounds = damage.boundingRect();
+    QRect bestRect;
+    QPoint bestDelta;
+    int bestScore = 0;
+    int bestLast = -1;
+    for (int last = 0; last < m_scrollHints.size(); ++last) {
+        const QRect area = m_scrollHints.at(last).area;
+        const QRect visible = area & now.rect();
+        QPoint sum;
+        for (int first = last; first >= 0 && m_scrollHints.at(first).area == area; --first) {
+            sum += m_scrollHints.at(first).delta;
+            // the moved content and where it came from both have to be inside the view
+            const QRect rect = bounds & visible & visible.translated(sum);
+            if (rect.isEmpty()) continue;
+            int score = 0;
+            for (int i = 0; i < SCROLL_SAMPLE_ROWS; ++i) {
+                const int y = rect.top() + (rect.height() - 1) * i / (SCROLL_SAMPLE_ROWS - 1);
+                if (rowMatches(now, before, y, rect.left(), rect.width(), sum)) ++score;
+            }
+            if (score > bestScore) {
+                bestScore = score;
+                bestRect = rect;
+                bestDelta = sum;
+                bestLast = last;
+            }
+        }
+    }
+    if (!bestScore) return copies;
+
+    // runs of matching rows become bands. Fixed headers and the like don't move with
+    // the page and break a run, so do rows whose source the client doesn't have yet
+    int runStart = -1;
+    auto endRun = [&](int end) {
+        if (runStart >= 0 && end - runStart >= MIN_COPY_ROWS)
+            copies.append(QRect(bestRect.left(), runStart, bestRect.width(), end - runStart));
+        runStart = -1;
+    };
+    for (int y = bestRect.top(); y <= bestRect.bottom(); ++y) {
+        const QRect source(bestRect.left() - bestDelta.x(), y - bestDelta.y(), bestRect.width(), 1);
+        const bool match = !m_clientStale.intersects(source)
+                           && rowMatches(now, before, y, bestRect.left(), bestRect.width(), bestDelta);
+        if (match && runStart < 0)
+            runStart = y;
+        else if (!match)
+            endRun(y);
+    }
+    endRun(bestRect.bottom() + 1);
+    if (copies.isEmpty()) return copies;
+
+    // no band may overwrite what a later one copies from: content that moved up is
+    // copied top down, content that moved down bottom up
+    if (bestDelta.y() > 0)
+        std::reverse(copies.begin(), copies.end());
+    for (const QRect& copy : std::as_const(copies))
+        damage -= copy;
+    delta = bestDelta;
+    // the client is past these scrolls now, only newer ones can still apply
+    m_scrollHints.remove(0, bestLast + 1);
+    return copies;
+}
+
+void VncSession::forgetClientFrame() {
+    m_clientFrame.reset();
+    m_clientStale = QRegion();
+    m_scrollHints.clear();
+}
+
+void VncSession::handleEnableContinuousUpdates(bool enable, const QRect& rect) {
+    if (!m_continuousEncoding) return; // we never said we support them
+
+    m_continuousUpdates = enable;
+    m_pacer.setContinuous(enable);
+    if (enable) {
+        m_continuousRegion = rect & QRect(QPoint(0, 0), m_screenSize);
+        qDebug() << "[Server] continuous updates on for" << m_continuousRegion.boundingRect();
+        serviceRequest();
+        return;
+    }
+
+    // the client needs to know where the last pushed update ends
+    m_continuousRegion = QRegion();
+    send(reinterpret_cast<const char*>(&END_OF_CONTINUOUS_UPDATES), 1);
     m_socket->flush();
+    qDebug() << "[Server] continuous updates off";
+}
+
+void VncSession::handleFence(quint32 flags, const QByteArray& payload) {
+    if (!(flags & FENCE_REQUEST)) {
+        // the answer to our own fence, the client has everything up to it
+        if (m_fenceInFlight) {
+            m_fenceInFlight = false;
+            m_pacer.rttMeasured(m_sinceFence.nsecsElapsed() / 1000000.0);
+        }
+        return;
+    }
+
+    PendingFence fence;
+    fence.flags = flags & FENCE_SUPPORTED;
+    fence.payload = payload;
+    // input before the fence has to have reached the page, so the answer waits until
+    // the injector delivered everything queued ahead of its marker
+    if (flags & FENCE_BLOCK_BEFORE)
+        fence.syncToken = m_inputInjector->postSync();
+    m_pendingFences.append(fence);
+    answerFences();
+}
+
+void VncSession::onInputSynced(quint64 token) {
+    bool found = false;
+    for (PendingFence& fence : m_pendingFences) {
+        if (fence.syncToken == token) {
+            fence.syncToken = 0;
+            found = true;
+        }
+    }
+    if (!found) return; // another session's marker
+
+    const bool wasBlocked = blockedByFence();
+    answerFences();
+    // whatever arrived behind a blocking fence is still waiting to be parsed
+    if (wasBlocked && !blockedByFence()) {
+        if (m_simulatedLatencyMs > 0)
+            processClientMessages();
+        else
+            onReadyRead();
+    }
+}
+
+void VncSession::answerFences() {
+    while (!m_pendingFences.isEmpty() && m_pendingFences.first().syncToken == 0) {
+        const PendingFence fence = m_pendingFences.takeFirst();
+        sendFence(fence.flags, fence.payload);
+    }
+}
+
+bool VncSession::blockedByFence() const {
+    for (const PendingFence& fence : m_pendingFences) {
+        if (fence.flags & FENCE_BLOCK_AFTER) return true;
+    }
+    return false;
+}
+
+void VncSession::sendFence(quint32 flags, const QByteArray& payload) {
+    uchar message[9];
+    message[0] = SERVER_FENCE;
+    message[1] = message[2] = message[3] = 0; // padding
+    qToBigEndian<quint32>(flags, message + 4);
+    message[8] = quint8(payload.size());
+    send(reinterpret_cast<const char*>(message), sizeof(message));
+    send(payload);
+    m_socket->flush();
+}
+
+void VncSession::onBytesWritten() {
+    if (!m_congested || unsentBytes() > SEND_BUDGET_BYTES / 2) return;
+
+    qCDebug(lcUpdates) << "[Server] client caught up, merged" << m_framesMerged << "frames while it was behind";
+    m_congested = false;
+    m_framesMerged = 0;
+    serviceRequest();
+}
+
+void VncSession::handleFramebufferUpdateRequest(bool incremental, const QRect& rect) {
+    const QRect requested = rect & QRect(QPoint(0, 0), m_screenSize);
+    if (requested.isEmpty()) return;
+
+    m_pacer.requestArrived();
+    m_requestedRegion += requested;
+    if (!incremental) {
+        // the client lost (or never had) this area, resend it whether it changed or not
+        m_forcedRegion += requested;
+    }
+    // whatever piled up since our last update can go right away, otherwise wait for
+    // the next snapshot with changes in it
+    serviceRequest();
+}
+
+void VncSession::handleSetPixelFormat(const PixelFormat& format) {
+    if (!format.isValid()) {
+        // a colour map client would read our pixels as palette indices, better to
+        // drop it than to show garbage
+        qWarning() << "[Server] unsupported pixel format, bpp:" << format.bitsPerPixel
+                   << "true colour:" << format.trueColour << "- disconnecting";
+        m_socket->disconnectFromHost();
+        return;
+    }
+
+    m_converter = PixelConverter(format);
+    // what the client has is in the old format, copying it around would keep those pixels
+    forgetClientFrame();
+    qDebug() << "[Server] client pixel format bpp:" << format.bitsPerPixel << "big endian:" << format.bigEndian
+             << "max:" << format.redMax << format.greenMax << format.blueMax
+             << "shift:" << format.redShift << format.greenShift << format.blueShift
+             << "kernel:" << (m_converter.isIdentity() ? "none" : m_converter.kernelName());
+}
+
+void VncSession::handleSetEncodings(const QVector<qint32>& encodings) {
+    m_encodings = encodings;
+    m_encoding = 0;
+    for (qint32 encoding : m_encodings) {
+        // ZRLE is no use without its zlib stream, the next one on the list does instead
+        if (encoding == 0 || encoding == ENCODING_HEXTILE || (encoding == ENCODING_ZRLE && m_zrleStream.ready())
+            || encoding == ENCODING_TIGHT) {
+            m_encoding = encoding;
+            break;
+        }
+    }
+    // the client's CompressLevel, if any, for the zlib streams, and its QualityLevel,
+    // without one Tight never goes lossy
+    int compressLevel = -1;
+    m_jpegQualityLevel = -1;
+    for (qint32 encoding : m_encodings) {
+        if (encoding >= ENCODING_COMPRESS_LEVEL_0 && encoding <= ENCODING_COMPRESS_LEVEL_9 && compressLevel < 0)
+            compressLevel = encoding - ENCODING_COMPRESS_LEVEL_0;
+        if (encoding >= ENCODING_QUALITY_LEVEL_0 && encoding <= ENCODING_QUALITY_LEVEL_9 && m_jpegQualityLevel < 0)
+            m_jpegQualityLevel = encoding - ENCODING_QUALITY_LEVEL_0;
+    }
+    if (compressLevel >= 0) {
+        m_zrleStream.setLevel(compressLevel);
+        m_tightStreams.setLevel(compressLevel);
+    }
+    qDebug() << "[Server] client encodings:" << m_encodings << "using:" << m_encoding
+             << "compress level:" << m_zrleStream.level() << "quality level:" << m_jpegQualityLevel;
+
+    const bool cursorEncoding = m_encodings.contains(ENCODING_CURSOR);
+    if (cursorEncoding && !m_cursorEncoding) {
+        // the client starts out without any shape, it gets the current one right away
+        m_cursor = m_cursorSource->currentCursor();
+        m_cursorDirty = !m_cursor.isNull();
+    }
+    m_cursorEncoding = cursorEncoding;
+
+    const bool extendedDesktopSize = m_encodings.contains(ENCODING_EXTENDED_DESKTOP_SIZE);
+    // the first ExtendedDesktopSize rectangle is how the client learns it may send
+    // SetDesktopSize at all, so it goes out without waiting for a resize
+    if (extendedDesktopSize && !m_extendedDesktopSizeEncoding)
+        m_announceSize = true;
+    m_extendedDesktopSizeEncoding = extendedDesktopSize;
+    m_desktopSizeEncoding = m_encodings.contains(ENCODING_DESKTOP_SIZE);
+    followFrameSize();
+    m_lastRectEncoding = m_encodings.contains(ENCODING_LAST_RECT);
+    m_copyRectEncoding = m_encodings.contains(ENCODING_COPY_RECT);
+    if (!m_copyRectEncoding)
+        forgetClientFrame(); // holding on to a snapshot nobody copies from only pins a capture slot
+
+    // an EndOfContinuousUpdates out of the blue is how the client learns we have them
+    const bool continuousEncoding = m_encodings.contains(ENCODING_CONTINUOUS_UPDATES);
+    if (continuousEncoding && !m_continuousEncoding) {
+        send(reinterpret_cast<const char*>(&END_OF_CONTINUOUS_UPDATES), 1);
+        m_socket->flush();
+    }
+    m_continuousEncoding = continuousEncoding;
+
+    // same for fences, the first one doubles as our first RTT sample
+    const bool fenceEncoding = m_encodings.contains(ENCODING_FENCE);
+    if (fenceEncoding && !m_fenceEncoding && !m_fenceInFlight) {
+        sendFence(FENCE_REQUEST | FENCE_BLOCK_BEFORE, QByteArray());
+        m_fenceInFlight = true;
+        m_sinceFence.start();
+    }
+    m_fenceEncoding = fenceEncoding;
+}
+
+void VncSession::handleSetDesktopSize(const QSize& size, int screenCount) {
+    if (!m_extendedDesktopSizeEncoding) return; // it can't be told the outcome
+
+    quint16 status = 0;
+    if (size.isEmpty() || screenCount != 1)
+        status = RESIZE_INVALID_LAYOUT; // we only ever have the one screen
+    else if (size.width() > MAX_DESKTOP_SIZE || size.height() > MAX_DESKTOP_SIZE)
+        status = RESIZE_OUT_OF_RESOURCES;
+
+    if (status != 0 || size == m_screenSize) {
+        // nothing to wait for, the answer can go out with the next update
+        answerResize(status);
+        return;
+    }
+    // answered once a snapshot of the new size arrives, the GUI thread does the resize
+    m_resizeRequested = true;
+    m_resizeSettled = false;
+    m_requestedSize = size;
+    m_resizeTimer->start(RESIZE_SETTLE_MS);
+    emit desktopSizeRequested(size);
+}
+
+void VncSession::onResizeTimer() {
+    if (!m_resizeRequested) return;
+    if (!m_resizeSettled && m_frameSource->frameSize() == m_requestedSize) {
+        // the view has it, the answer goes out with the first snapshot of that size
+        m_resizeSettled = true;
+        m_resizeTimer->start(RESIZE_TIMEOUT_MS - RESIZE_SETTLE_MS);
+        m_frameSource->requestFrame();
+        return;
+    }
+    // the window manager kept another size (or none changed at all), or the snapshot
+    // never came. Either way the client is told its request did not go through
+    qWarning() << "[Server] desktop size" << m_requestedSize << "not applied, view is" << m_frameSource->frameSize();
+    answerResize(RESIZE_PROHIBITED);
+}
+
+void VncSession::answerResize(quint16 status) {
+    m_resizeRequested = false;
+    m_resizeTimer->stop();
+    m_announceSize = true;
+    m_sizeReason = 1;
+    m_sizeStatus = status;
+    serviceRequest();
+}
+
+void VncSession::sendDesktopSize() {
+    const quint16 width = quint16(m_screenSize.width());
+    const quint16 height = quint16(m_screenSize.height());
+
+    QByteArray message;
+    QDataStream out(&message, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+    out << quint8(0) << quint8(0) << quint16(1); // FramebufferUpdate with one rectangle
+    if (m_extendedDesktopSizeEncoding) {
+        out << m_sizeReason << m_sizeStatus << width << height << ENCODING_EXTENDED_DESKTOP_SIZE;
+        // a single screen covering the whole framebuffer: count, padding, then id,
+        // position, size and flags
+        out << quint8(1) << quint8(0) << quint16(0);
+        out << quint32(0) << quint16(0) << quint16(0) << width << height << quint32(0);
+    } else {
+        out << quint16(0) << quint16(0) << width << height << ENCODING_DESKTOP_SIZE;
+    }
+    send(message);
+    m_socket->flush();
+
+    qDebug() << "[Server] announced desktop size" << m_screenSize << "reason:" << m_sizeReason
+             << "status:" << m_sizeStatus;
+    m_announceSize = false;
+    forgetClientFrame(); // the client starts over with an empty framebuffer
+    // continuous updates never reach past the framebuffer, a shrink cuts the area down too
+    m_continuousRegion &= QRect(QPoint(0, 0), m_screenSize);
+    m_sizeReason = 0;
+    m_sizeStatus = 0;
+    m_requestedRegion = QRegion();
+    m_pacer.updateSent(0);
+}
+
+void VncSession::handleInput() {
+    // latency counts from the oldest input the screen has not reacted to yet
+    if (!m_sinceInput.isValid())
+        m_sinceInput.start();
+    m_pacer.inputArrived();
 }
 
 void VncSession::onReadyRead() {
-    m_buffer.append(m_socket->readAll());
+    if (m_simulatedLatencyMs > 0) {
+        // everything the client sent shows up half a round trip later, our answers
+        // take the other half in send()
+        const int delay = m_simulatedLatencyMs - m_simulatedLatencyMs / 2;
+        if (!m_latencyClock.isValid()) m_latencyClock.start();
+        m_delayedInput.append(qMakePair(m_latencyClock.elapsed() + delay, m_socket->readAll()));
+        if (!m_latencyTimer->isActive())
+            m_latencyTimer->start(delay);
+        return;
+    }
+
+    // the ring only takes what fits, so read and parse in turns until the socket is empty
+    while (true) {
+        const qint64 got = m_input.readFrom(m_socket);
+        doHandshake();
+        if (m_handshakeDone && !processClientMessages()) return;
+        if (got == 0 || m_socket->bytesAvailable() == 0) return;
+    }
+}
+
+void VncSession::onDelayedInput() {
+    const qint64 now = m_latencyClock.elapsed();
+    while (!m_delayedInput.isEmpty() && m_delayedInput.first().first <= now) {
+        const QByteArray data = m_delayedInput.takeFirst().second;
+        m_input.append(data.constData(), data.size());
+    }
+    if (!m_delayedInput.isEmpty())
+        m_latencyTimer->start(int(m_delayedInput.first().first - now));
+
     doHandshake();
-    if (m_handshakeDone) {
-        processClientMessage();
+    if (m_handshakeDone)
+        processClientMessages();
+}
+
+void VncSession::send(const char* data, qint64 size) {
+    if (m_simulatedLatencyMs <= 0) {
+        m_socket->write(data, size);
+        return;
     }
+
+    // whatever goes out in the same millisecond travels together
+    if (!m_latencyClock.isValid()) m_latencyClock.start();
+    const qint64 due = m_latencyClock.elapsed() + m_simulatedLatencyMs / 2;
+    if (m_delayedOutput.isEmpty() || m_delayedOutput.last().first != due)
+        m_delayedOutput.append(qMakePair(due, QByteArray()));
+    m_delayedOutput.last().second.append(data, size);
+    m_delayedOutputBytes += size;
+    if (!m_outputLatencyTimer->isActive())
+        m_outputLatencyTimer->start(int(m_delayedOutput.first().first - m_latencyClock.elapsed()));
+}
+
+void VncSession::onDelayedOutput() {
+    const qint64 now = m_latencyClock.elapsed();
+    while (!m_delayedOutput.isEmpty() && m_delayedOutput.first().first <= now) {
+        const QByteArray data = m_delayedOutput.takeFirst().second;
+        m_delayedOutputBytes -= data.size();
+        m_socket->write(data);
+    }
+    m_socket->flush();
+    if (!m_delayedOutput.isEmpty())
+        m_outputLatencyTimer->start(int(m_delayedOutput.first().first - now));
 }
 
 void VncSession::onDisconnected() {
     qDebug() << "Client disconnected";
+    // a drag this client started must not stay pressed for everybody else
+    m_inputInjector->postSourceGone(this);
     m_socket->deleteLater();
     deleteLater();
 }
@@ -63,34 +762,37 @@ void VncSession::onDisconnected() {
 void VncSession::doHandshake() {
     while (!m_handshakeDone) {
         switch (m_handshakeState) {
-        case HandshakeState::ReadingProtocolVersion:
-            if (m_buffer.size() < 12) return;
-            m_buffer.remove(0, 12);
+        case HandshakeState::ReadingProtocolVersion: {
+            char version[12];
+            if (!m_input.take(version, sizeof(version))) return;
             m_handshakeState = HandshakeState::SendingSecurityTypes;
             break;
+        }
         case HandshakeState::SendingSecurityTypes:
-            m_socket->write("\x01\x01", 2);
+            send("\x01\x01", 2);
             m_socket->flush();
             m_handshakeState = HandshakeState::ReadingChosenSecurityType;
             break;
-        case HandshakeState::ReadingChosenSecurityType:
-            if (m_buffer.size() < 1) return;
-            m_buffer.remove(0, 1);
+        case HandshakeState::ReadingChosenSecurityType: {
+            quint8 securityType;
+            if (!m_input.take(&securityType, 1)) return;
             m_handshakeState = HandshakeState::SendingSecurityResult;
             break;
+        }
         case HandshakeState::SendingSecurityResult: {
             quint32 secResult = 0;
             secResult = qToBigEndian(secResult);
-            m_socket->write(reinterpret_cast<const char*>(&secResult), 4);
+            send(reinterpret_cast<const char*>(&secResult), 4);
             m_socket->flush();
             m_handshakeState = HandshakeState::ReadingClientInit;
             break;
         }
-        case HandshakeState::ReadingClientInit:
-            if (m_buffer.size() < 1) return;
-            m_buffer.remove(0, 1);
+        case HandshakeState::ReadingClientInit: {
+            quint8 sharedFlag;
+            if (!m_input.take(&sharedFlag, 1)) return;
             m_handshakeState = HandshakeState::SendingServerInit;
             break;
+        }
         case HandshakeState::SendingServerInit:
             sendServerInit();
             m_handshakeDone = true;
@@ -107,96 +809,286 @@ void VncSession::sendServerInit() {
     QDataStream out(&initBytes, QIODevice::WriteOnly);
     out.setByteOrder(QDataStream::BigEndian);
 
-    int screenWidth = m_view ? m_view->width() : 640;
-    int screenHeight = m_view ? m_view->height() : 480;
+    const QSize frameSize = m_frameSource->frameSize();
+    int screenWidth = frameSize.width();
+    int screenHeight = frameSize.height();
+    m_screenSize = frameSize;
 
     out << (quint16)screenWidth;
     out << (quint16)screenHeight;
 
-    out << (quint8)32 << (quint8)24 << (quint8)0 << (quint8)1;
-    out << (quint16)255 << (quint16)255 << (quint16)255;
-    out << (quint8)16 << (quint8)8 << (quint8)0;
-    out.writeRawData("\0\0\0", 3);
+    // exactly how a Format_RGB32 frame sits in memory: 0xffRRGGBB as a native 32 bit
+    // word, so B G R X bytes on little endian hosts. Raw updates go out without touching
+    // a single pixel
+    uchar pixelFormat[16];
+    PixelFormat::native().toWire(pixelFormat);
+    out.writeRawData(reinterpret_cast<const char*>(pixelFormat), sizeof(pixelFormat));
 
     QString desktopName = "Qt VNC Browser";
     QByteArray nameBytes = desktopName.toUtf8();
     out << (quint32)nameBytes.size();
     out.writeRawData(nameBytes.constData(), nameBytes.size());
 
-    m_socket->write(initBytes);
+    send(initBytes);
     m_socket->flush();
-    forceInitialUpdate();
-    m_updateTimer.start();
+
+    // the client has nothing yet, so whatever it requests first is all damage
+    m_handshakeDone = true;
+    m_damage = QRect(QPoint(0, 0), m_screenSize);
+    m_latestFrame = m_frameSource->latestFrame();
 }
 
-void VncSession::sendFramebufferUpdate() {
-    if (!m_view) return;
+bool VncSession::sendFramebufferUpdate() {
+    const QRegion wanted = wantedRegion();
+    if (wanted.isEmpty() || m_congested) return false;
+    // a size change goes alone, the client requests the new area once it resized
+    if (m_announceSize) {
+        sendDesktopSize();
+        return true;
+    }
+    if (!m_latestFrame) return false;
+
+    // only look at damage inside the outstanding request, the rest stays pending
+    QRegion damage = (m_damage | m_forcedRegion) & wanted;
+    damage &= QRect(QPoint(0, 0), m_screenSize) & m_latestFrame->image.rect();
+    // a new cursor shape goes out on its own, pointer motion alone never costs a
+    // single framebuffer byte since the captures don't contain a cursor
+    const bool sendCursor = m_cursorEncoding && m_cursorDirty && m_cursor;
+    // nothing changed yet, keep the request open until something does
+    if (damage.isEmpty() && !sendCursor) return false;
 
-    m_view->update();
-    QCoreApplication::processEvents(QEventLoop::AllEvents, 50);
+    m_damage -= damage;
+    m_forcedRegion -= damage;
+    m_requestedRegion = QRegion();
 
-    QPixmap capture = m_view->grab();
+    // captured frames are already in the format we advertised
+    const QImage& image = m_latestFrame->image;
 
-    if (QOpenGLWidget* gl = m_view->findChild<QOpenGLWidget*>()) {
-        QImage glImage = gl->grabFramebuffer();
-        QPainter p(&capture);
-        p.drawImage(gl->geometry().topLeft(), glImage);
-        p.end();
-    }
+    // after a scroll most of the view is already on the client, just somewhere else.
+    // Those bands become CopyRects and only what's left gets encoded
+    QPoint copyDelta;
+    const QList<QRect> copies = m_copyRectEncoding ? findScrollCopies(damage, copyDelta) : QList<QRect>();
+
+    // lots of tiny rectangles cost more in headers than they save in pixels
+    QList<QRect> rects;
+    if (damage.rectCount() > MAX_UPDATE_RECTS)
+        rects.append(damage.boundingRect());
+    else
+        rects = QList<QRect>(damage.begin(), damage.end());
 
-    QImage image = capture.toImage().convertToFormat(QImage::Format_RGBA8888);
-    quint16 w = image.width();
-    quint16 h = image.height();
+    // every tile is encoded on its own and becomes its own rectangle on the wire,
+    // the results land in per tile slots so the wire order never depends on which
+    // worker finished first. Slots are reused from update to update
+    splitIntoTiles(rects, m_tiles);
+    const int tileCount = m_tiles.size();
+    int allocations = 0;
+    if (m_outgoing.size() < tileCount) {
+        allocations += tileCount - m_outgoing.size();
+        m_outgoing.resize(tileCount);
+    }
+    if (m_encoding == ENCODING_TIGHT && m_tightTiles.size() < tileCount) {
+        ++allocations;
+        m_tightTiles.resize(tileCount);
+    }
+    OutgoingRect* results = m_outgoing.data(); // detach once here, not from the workers
+    TightTile* tightTiles = m_tightTiles.data();
+    const QRect* tiles = m_tiles.constData();
 
-    QByteArray update;
-    QDataStream stream(&update, QIODevice::WriteOnly);
-    stream.setVersion(QDataStream::Qt_5_0);
-    stream.setByteOrder(QDataStream::BigEndian);
+    // the cursor is tiny, it goes first so the tiles can follow as they finish
+    if (sendCursor) {
+        m_cursorRect.reset();
+        encodeCursorRect(*m_cursor, m_converter, m_cursorRect);
+        m_cursorDirty = false;
+    }
+    // then the scroll copies, before any tile can overwrite what they copy from
+    m_copyRects.reset();
+    for (const QRect& copy : std::as_const(copies)) {
+        m_copyRects.appendRectHeader(copy, ENCODING_COPY_RECT);
+        uchar source[4];
+        qToBigEndian<quint16>(quint16(copy.x() - copyDelta.x()), source);
+        qToBigEndian<quint16>(quint16(copy.y() - copyDelta.y()), source + 2);
+        m_copyRects.append(reinterpret_cast<const char*>(source), sizeof(source));
+    }
+    const int rectCount = tileCount + int(copies.size()) + (sendCursor ? 1 : 0);
+    // with LastRect the count is left open and each tile goes out the moment it and
+    // the ones before it are encoded, instead of after the whole update is done
+    const bool streaming = m_lastRectEncoding && tileCount > 1;
 
     // --- FramebufferUpdate Header ---
-    stream << (quint8)0      // message type: 0 = FramebufferUpdate
-           << (quint8)0      // padding (0)
-           << (quint16)1;    // number of rectangles (1)
+    uchar header[4];
+    header[0] = 0;                                // message type: 0 = FramebufferUpdate
+    header[1] = 0;                                // padding (0)
+    qToBigEndian<quint16>(streaming ? LAST_RECT_COUNT : quint16(rectCount), header + 2); // number of rectangles
+
+    // gather write: header, then every segment of every rectangle in order. QTcpSocket
+    // has no vectored write, but handing it the ranges one by one means its own write
+    // buffer is the only copy the pixels ever go through
+    qint64 written = 0;
+    qint64 bytesCopied = 0;
+    qint64 firstRectNsecs = -1;
+    QElapsedTimer encodeTimer;
+    encodeTimer.start();
+    auto writeRect = [&](const OutgoingRect& rect) {
+        for (const IoSegment& segment : rect.segments) {
+            send(rect.segmentData(segment), segment.size);
+            written += segment.size;
+        }
+        bytesCopied += rect.bytesCopied;
+        allocations += rect.allocations;
+    };
+    // ZRLE and most Tight tiles still have to go through a deflate stream, in wire order
+    auto writeTile = [&](int i) {
+        const bool zrle = m_encoding == ENCODING_ZRLE;
+        if (!zrle && (m_encoding != ENCODING_TIGHT || tightTiles[i].stream < 0)) {
+            writeRect(results[i]);
+            return;
+        }
+        m_deflatedRect.reset();
+        bool deflated = true;
+        if (zrle)
+            deflated = m_zrleStream.deflateRect(tiles[i], results[i], m_deflatedRect);
+        else
+            deflated = m_tightStreams.deflateTile(tightTiles[i], results[i], m_deflatedRect);
+        if (!deflated) {
+            // the stream is unusable, this tile goes out raw instead
+            m_deflatedRect.reset();
+            encodeRawRect(image, tiles[i], m_converter, m_deflatedRect);
+        }
+        writeRect(m_deflatedRect);
+        bytesCopied += results[i].bytesCopied;
+        allocations += results[i].allocations;
+    };
+    auto encodeTile = [&](int i) {
+        results[i].reset();
+        switch (m_encoding) {
+        case ENCODING_HEXTILE:
+            encodeHextileRect(image, tiles[i], m_converter, results[i]);
+            break;
+        case ENCODING_ZRLE:
+            encodeZrleTiles(image, tiles[i], m_converter, results[i]);
+            break;
+        case ENCODING_TIGHT:
+            tightTiles[i] = encodeTightRect(image, tiles[i], m_converter, m_jpegQualityLevel, results[i]);
+            break;
+        default:
+            encodeRawRect(image, tiles[i], m_converter, results[i]);
+            break;
+        }
+    };
 
-    // --- Rectangle header ---
-    stream << (quint16)0         // x position
-           << (quint16)0         // y position
-           << w                  // width
-           << h                  // height
-           << (qint32)0;         // encoding type: 0 = raw
+    send(reinterpret_cast<const char*>(header), sizeof(header));
+    written += sizeof(header);
+    if (sendCursor)
+        writeRect(m_cursorRect);
+    if (!copies.isEmpty())
+        writeRect(m_copyRects);
 
-    // --- Pixel data ---
-    int rowBytes = w * 4;
-    for (int y = 0; y < h; ++y) {
-        const uchar* row = image.constScanLine(y);
-        update.append(reinterpret_cast<const char*>(row), rowBytes);
+    if (streaming) {
+        m_scheduler->parallelForOrdered(tileCount, encodeTile, [&](int i) {
+            writeTile(i);
+            // flushing hands the tile to the kernel now rather than when we return
+            m_socket->flush();
+            if (firstRectNsecs < 0) firstRectNsecs = encodeTimer.nsecsElapsed();
+        });
+        // zero sized rectangle with the LastRect encoding closes the update
+        m_lastRect.reset();
+        m_lastRect.appendRectHeader(QRect(), ENCODING_LAST_RECT);
+        writeRect(m_lastRect);
+    } else {
+        m_scheduler->parallelFor(tileCount, encodeTile);
+        firstRectNsecs = encodeTimer.nsecsElapsed();
+        for (int i = 0; i < tileCount; ++i)
+            writeTile(i);
     }
+    const qint64 encodeNsecs = encodeTimer.nsecsElapsed();
+    bytesCopied += written; // everything written was copied once more into the socket buffer
+    m_socket->flush();
 
-    qDebug() << "Sending framebuffer update of size:" << update.size();
-    qDebug() << "Sent header bytes (first 20):" << update.left(20).toHex();
+    // a client that can't keep up gets nothing new until most of this has drained,
+    // so a slow session holds at most the budget plus one update in memory
+    if (unsentBytes() > SEND_BUDGET_BYTES)
+        m_congested = true;
 
-    m_socket->write(update);
-    m_socket->flush();
+    m_bytesCopied += bytesCopied;
+    m_allocations += allocations;
+    m_pacer.updateSent(encodeNsecs);
+    // everything sent is now on the client as in this snapshot, the damage left over is not
+    if (m_copyRectEncoding) {
+        m_clientFrame = m_latestFrame;
+        m_clientStale = m_damage;
+    }
 
-    image.save("framebuffer_output.png");
-}
+    // taken whether or not the line below is enabled, they only count since the last call
+    const qint64 deflateNsecs = m_zrleStream.takeDeflateNsecs() + m_tightStreams.takeDeflateNsecs();
+    qCDebug(lcUpdates) << "Sent framebuffer update with" << tileCount << "rects, size:" << written
+                       << "frame:" << m_latestFrame->serial
+                       << "capture stall ms:" << m_latestFrame->captureNsecs / 1000000.0
+                       << "encode ms:" << encodeNsecs / 1000000.0 << "on" << m_scheduler->workerCount() << "workers"
+                       << "first rect ms:" << firstRectNsecs / 1000000.0 << (streaming ? "streamed" : "")
+                       << "bytes copied:" << bytesCopied << "allocations:" << allocations
+                       << "fps:" << m_pacer.achievedFps() << "rtt ms:" << m_pacer.rttMs()
+                       << "bpp:" << m_converter.format().bitsPerPixel << "encoding:" << m_encoding
+                       << "deflate ms:" << deflateNsecs / 1000000.0
+                       << "cursor:" << (sendCursor ? m_cursor->serial : 0) << "scroll copies:" << copies.size()
+                       << "mode:" << (m_continuousUpdates ? "continuous" : "request");
 
-void VncSession::processClientMessage() {
-    qDebug() << "[Server] processClientMessage() - buffered:" << m_buffer.size();
-    while (m_buffer.size() > 0) {
-        quint8 msgType = static_cast<quint8>(m_buffer.at(0));
-        if (msgType == 3 && m_buffer.size() >= 10) {
-            m_buffer.remove(0, 10);
-            sendFramebufferUpdate();
-            qDebug() << "[Server] Handling FramebufferUpdateRequest.";
-        } else {
-            m_buffer.remove(0, 1);
-        }
+    if (++m_updatesSent % SUMMARY_UPDATES == 0) {
+        qDebug() << "[Server] sent" << m_updatesSent << "updates, fps:" << achievedFps()
+                 << "bytes copied:" << m_bytesCopied << "input to damage ms:" << inputLatencyMs()
+                 << "worst:" << maxInputLatencyMs() << "rtt ms:" << m_pacer.rttMs()
+                 << "mode:" << (m_continuousUpdates ? "continuous" : "request");
     }
+    return true;
 }
 
-void VncSession::forceInitialUpdate() {
-    QTimer::singleShot(500, this, [this]() {
-        sendFramebufferUpdate();
-    });
+bool VncSession::processClientMessages() {
+    while (true) {
+        // parsing resumes from onInputSynced() once the fence was answered
+        if (blockedByFence()) return true;
+
+        switch (m_input.next(m_message)) {
+        case RfbInput::Status::Incomplete:
+            return true;
+        case RfbInput::Status::Invalid:
+            // message lengths depend on the type, past an unknown one every byte we
+            // read would be misinterpreted
+            qWarning() << "[Server] unknown client message, disconnecting";
+            m_socket->disconnectFromHost();
+            return false;
+        case RfbInput::Status::Ready:
+            break;
+        }
+
+        switch (m_message.type) {
+        case ClientMessage::SetPixelFormat:
+            handleSetPixelFormat(m_message.pixelFormat);
+            break;
+        case ClientMessage::SetEncodings:
+            handleSetEncodings(m_message.encodings);
+            break;
+        case ClientMessage::FramebufferUpdateRequest:
+            handleFramebufferUpdateRequest(m_message.incremental, m_message.rect);
+            break;
+        case ClientMessage::KeyEvent:
+            m_inputInjector->postKey(m_message.down, m_message.keysym);
+            handleInput();
+            break;
+        case ClientMessage::PointerEvent:
+            m_inputInjector->postPointer(this, m_message.buttonMask, m_message.position);
+            handleInput();
+            break;
+        case ClientMessage::ClientCutText:
+            qCDebug(lcUpdates) << "[Server] client cut text," << m_message.text.size() << "bytes";
+            break;
+        case ClientMessage::EnableContinuousUpdates:
+            handleEnableContinuousUpdates(m_message.enable, m_message.rect);
+            break;
+        case ClientMessage::Fence:
+            handleFence(m_message.fenceFlags, m_message.fencePayload);
+            break;
+        case ClientMessage::SetDesktopSize:
+            handleSetDesktopSize(m_message.desktopSize, m_message.screenCount);
+            break;
+        }
+    }
 }
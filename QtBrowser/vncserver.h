@@ -7,6 +7,21 @@
 #include <QWidget>
 #include <QObject>
 #include <QTimer>
+#include <QThread>
+#include <QRegion>
+#include <QElapsedTimer>
+#include "framesource.h"
+#include "taskscheduler.h"
+#include "rfboutput.h"
+#include "framepacer.h"
+#include "pixelformat.h"
+#include "rfbinput.h"
+#include "inputinjector.h"
+#include "cursorsource.h"
+#include "scrolltracker.h"
+#include "hextileencoder.h"
+#include "zrleencoder.h"
+#include "tightencoder.h"
 
 class VncSession; // this is a forward declaration for the session class
 
@@ -16,45 +31,273 @@ class VncServer : public QTcpServer
 
 public:
     explicit VncServer(QWidget* view, QObject* parent = nullptr);
+    ~VncServer();
+
+    // every session paces itself inside this range, applies to sessions that connect
+    // after the call
+    void setFrameRateLimits(double minFps, double maxFps);
+    // holds traffic back both ways so a round trip takes this long, to try streaming
+    // over a slow link on localhost. Applies to sessions that connect after the call
+    void setSimulatedLatency(int ms) { m_simulatedLatencyMs = ms; }
+
+public slots:
+    // a client asked for another framebuffer size. Resizes the view by resizing its
+    // window, every session then sees the new size in the next snapshot. The window
+    // manager may clamp or ignore it, the asking session checks what the view got
+    void resizeDesktop(const QSize& size);
 
 protected:
     void incomingConnection(qintptr socketDescriptor) override;
 
 private:
     QWidget* m_view;
+    // captures once per frame and fans the snapshot out to every session
+    FrameSource* m_frameSource;
+    // every session's keyboard and mouse end up here, on the GUI thread
+    InputInjector* m_inputInjector;
+    // the cursor shape under the remote pointer, for clients that draw it themselves
+    CursorSource* m_cursorSource;
+    // scrolling of the visible page, turned into CopyRect by the sessions
+    ScrollTracker* m_scrollTracker;
+    // sessions are spread over these so encoding and socket writes never run on the
+    // GUI thread, which is busy driving chromium
+    QList<QThread*> m_ioThreads;
+    int m_nextIoThread = 0;
+    // shared by every session, sized so the workers plus the I/O threads helping with
+    // their own updates fit the cores
+    TaskScheduler m_encodeScheduler;
+    double m_minFps;
+    double m_maxFps;
+    int m_simulatedLatencyMs = 0;
 };
 
 // VncSession handles a single VNC client connection and implements the RFB 3.8 handshake
 // sends full ServerInit, processes FramebufferUpdateRequest (type 3), KeyEvent (type 4),
 // and PointerEvent (type 5) I dont think I need any others for this but Ill come back
-// to this
+// to this. A session lives on one of the servers I/O threads, the only thing it shares
+// with the GUI thread are the frame snapshots
 class VncSession : public QObject
 {
     Q_OBJECT
 
 public:
-    explicit VncSession(qintptr socketDescriptor, QWidget* view, QObject* parent = nullptr);
+    explicit VncSession(qintptr socketDescriptor, FrameSource* frameSource, InputInjector* inputInjector,
+                        CursorSource* cursorSource, ScrollTracker* scrollTracker, TaskScheduler* scheduler,
+                        QObject* parent = nullptr);
+
+    // running totals of bytes we copied on the way to the socket (the sockets own
+    // buffer included) and of buffer allocations made while building updates
+    quint64 bytesCopied() const { return m_bytesCopied; }
+    quint64 allocations() const { return m_allocations; }
+
+    // set before the session is moved to its thread, the pacer belongs to that thread after
+    void setFrameRateLimits(double minFps, double maxFps) { m_pacer.setFpsRange(minFps, maxFps); }
+    // same, see VncServer::setSimulatedLatency()
+    void setSimulatedLatency(int ms) { m_simulatedLatencyMs = ms; }
+    // updates per second this client actually got over the last second
+    double achievedFps() const { return m_pacer.achievedFps(); }
+    // time from this client's input to the next frame with damage in it, last and worst
+    double inputLatencyMs() const { return m_inputLatencyMs; }
+    double maxInputLatencyMs() const { return m_maxInputLatencyMs; }
+
+public slots:
+    // creates the socket, so it has to run on the thread the session was moved to
     void start();
 
+signals:
+    // SetDesktopSize from this client, handled by the server on the GUI thread
+    void desktopSizeRequested(const QSize& size);
+
 private slots:
     void onReadyRead();
     void onDisconnected();
+    void onFrameReady(const FramePtr& frame);
+    void onBytesWritten();
+    void onCursorChanged(const CursorPtr& cursor);
+    void onScrolled(const QRect& area, const QPoint& delta);
+    void onInputSynced(quint64 token);
+    void onDelayedInput();
+    void onDelayedOutput();
+    void onResizeTimer();
 
 private:
-    QTcpSocket* m_socket;
-    QWidget* m_view;
+    qintptr m_socketDescriptor;
+    QTcpSocket* m_socket = nullptr;
+    FrameSource* m_frameSource;
+    InputInjector* m_inputInjector;
+    CursorSource* m_cursorSource;
+    ScrollTracker* m_scrollTracker;
+    TaskScheduler* m_scheduler;
     bool m_handshakeDone;
-    QByteArray m_buffer;
+    // everything the client sent that we have not parsed yet
+    RfbInput m_input;
+    ClientMessage m_message;
+    // SetEncodings, most preferred first. Raw is always allowed on top of these
+    QVector<qint32> m_encodings;
+    // the first of the client's encodings we can produce, raw if none
+    qint32 m_encoding = 0;
+
+    // framebuffer size we announced in ServerInit, rectangles never go outside of it
+    QSize m_screenSize;
+    // newest shared snapshot, updates are always cut from this one
+    FramePtr m_latestFrame;
+    // changed area the client has not seen yet, the union of snapshot damage since
+    // the last update we sent it
+    QRegion m_damage;
+    // area covered by FramebufferUpdateRequests we have not answered yet. Empty means
+    // the client has not asked for anything and we must not send
+    QRegion m_requestedRegion;
+    // non incremental requests, sent in full even if nothing changed
+    QRegion m_forcedRegion;
+
+    // what the client asked for with SetPixelFormat, our native format until it does
+    PixelConverter m_converter;
+
+    // Cursor pseudo encoding (-239). The client draws the pointer locally, we only send
+    // the shape, and only when it changed since the last one it got
+    bool m_cursorEncoding = false;
+    bool m_cursorDirty = false;
+    CursorPtr m_cursor;
+    OutgoingRect m_cursorRect;
+
+    // CopyRect (1), for scrolling. m_clientFrame is the snapshot our last update came
+    // from and m_clientStale where the client still differs from it, together that is
+    // what the client has on screen. Scroll hints are checked against it pixel by pixel
+    struct ScrollHint
+    {
+        QRect area;
+        QPoint delta;
+    };
+    bool m_copyRectEncoding = false;
+    FramePtr m_clientFrame;
+    QRegion m_clientStale;
+    QList<ScrollHint> m_scrollHints; // newest last
+    OutgoingRect m_copyRects;
+
+    // DesktopSize (-223) and ExtendedDesktopSize (-308). A snapshot of another size
+    // than m_screenSize is announced in an update of its own before any pixels of it,
+    // clients with neither keep the size from ServerInit
+    bool m_desktopSizeEncoding = false;
+    bool m_extendedDesktopSizeEncoding = false;
+    bool m_announceSize = false;
+    quint16 m_sizeReason = 0; // 0 server, 1 this client asked
+    quint16 m_sizeStatus = 0; // 0 done, otherwise why this clients request failed
+    // this client's SetDesktopSize is in flight. A snapshot of m_requestedSize is the
+    // answer, the timer first checks what size the view actually got once the window
+    // manager had its say, then gives up on a snapshot that never comes
+    bool m_resizeRequested = false;
+    bool m_resizeSettled = false;
+    QSize m_requestedSize;
+    QTimer* m_resizeTimer;
+
+    // tiles of the update being built and one reusable output slot per tile
+    QList<QRect> m_tiles;
+    QList<OutgoingRect> m_outgoing;
+    quint64 m_bytesCopied = 0;
+    quint64 m_allocations = 0;
+    quint64 m_updatesSent = 0;
+
+    // set when the socket holds more unsent bytes than the budget, cleared once it
+    // drained to half of it. Frames that arrive meanwhile only add to m_damage
+    bool m_congested = false;
+    int m_framesMerged = 0;
+
+    // spaces updates by damage rate, client RTT and encode cost. While it holds an
+    // update back the timer brings us back to serviceRequest()
+    FramePacer m_pacer;
+    QTimer* m_paceTimer;
+
+    // LastRect (-224), updates are written tile by tile while the rest still encodes
+    bool m_lastRectEncoding = false;
+    OutgoingRect m_lastRect;
+
+    // ZRLE (16) and Tight (7): workers build the tile data in m_outgoing, this thread
+    // deflates each tile through the session's streams into m_deflatedRect right before
+    // it is written
+    ZrleStream m_zrleStream;
+    TightStreams m_tightStreams;
+    QList<TightTile> m_tightTiles; // which stream each slot still needs, Tight only
+    int m_jpegQualityLevel = -1; // the client's QualityLevel, -1 keeps Tight lossless
+    OutgoingRect m_deflatedRect;
+
+    // ContinuousUpdates (-313): once enabled, damage inside m_continuousRegion is
+    // pushed as it happens instead of waiting for a request per update
+    bool m_continuousEncoding = false;
+    bool m_continuousUpdates = false;
+    QRegion m_continuousRegion;
+
+    // Fence (-312). Client fences are answered in order, one that has to wait for
+    // earlier input to reach the page holds the ones behind it. Our own fences measure
+    // RTT while no requests come in, one at a time
+    struct PendingFence
+    {
+        quint64 syncToken = 0; // input injector marker still in flight, 0 once it was delivered
+        quint32 flags = 0;
+        QByteArray payload;
+    };
+    bool m_fenceEncoding = false;
+    QList<PendingFence> m_pendingFences;
+    bool m_fenceInFlight = false;
+    QElapsedTimer m_sinceFence;
+
+    // a simulated round trip of m_simulatedLatencyMs, split over both directions: bytes
+    // from the client wait in m_delayedInput before they are parsed, ours wait in
+    // m_delayedOutput before they reach the socket
+    int m_simulatedLatencyMs = 0;
+    QList<QPair<qint64, QByteArray>> m_delayedInput;
+    QList<QPair<qint64, QByteArray>> m_delayedOutput;
+    qint64 m_delayedOutputBytes = 0;
+    QElapsedTimer m_latencyClock;
+    QTimer* m_latencyTimer;
+    QTimer* m_outputLatencyTimer;
+
+    // runs from the first input after a damaged frame until the next damaged frame
+    QElapsedTimer m_sinceInput;
+    double m_inputLatencyMs = 0.0;
+    double m_maxInputLatencyMs = 0.0;
 
-    // removed fixed screen dimensions. We now use the views current size at update time
-    QTimer m_updateTimer; // periodically send fullframe updates
+    // everything for the client goes through here, so a simulated latency can hold it back
+    void send(const char* data, qint64 size);
+    void send(const QByteArray& data) { send(data.constData(), data.size()); }
+    // written but not yet sent, the delayed bytes included
+    qint64 unsentBytes() const { return m_socket->bytesToWrite() + m_delayedOutputBytes; }
 
     // handshake and message methods
     void doHandshake();
     void sendServerInit();
-    void processClientMessage();
-    void sendFramebufferUpdate();
-    void forceInitialUpdate();
+    // handles every complete message in m_input, false if the client had to be dropped
+    bool processClientMessages();
+    void handleFramebufferUpdateRequest(bool incremental, const QRect& rect);
+    void handleSetPixelFormat(const PixelFormat& format);
+    void handleSetEncodings(const QVector<qint32>& encodings);
+    void handleSetDesktopSize(const QSize& size, int screenCount);
+    // the pending size announcement as an update of its own
+    void sendDesktopSize();
+    // picks up a snapshot size that differs from what the client was told, if it can be told
+    void followFrameSize();
+    // replies to this client's SetDesktopSize with the current size
+    void answerResize(quint16 status);
+    void handleEnableContinuousUpdates(bool enable, const QRect& rect);
+    void handleFence(quint32 flags, const QByteArray& payload);
+    void sendFence(quint32 flags, const QByteArray& payload);
+    // answers client fences from the front of the queue for as long as they are ready
+    void answerFences();
+    // a client fence asked us to stop parsing until it was answered
+    bool blockedByFence() const;
+    // what we may send right now: the open request plus the continuous area
+    QRegion wantedRegion() const;
+    // bands of damage the client can copy from its own framebuffer after a scroll,
+    // taken out of damage. Empty when no hint holds up against the pixels
+    QList<QRect> findScrollCopies(QRegion& damage, QPoint& delta);
+    // the client's framebuffer no longer matches any snapshot we know
+    void forgetClientFrame();
+    void handleInput();
+    // answers the outstanding request if the socket has room, otherwise asks for the
+    // next snapshot with changes in it
+    void serviceRequest();
+    // answers the outstanding request from the latest snapshot, false if there was
+    // nothing to send yet
+    bool sendFramebufferUpdate();
 
     enum class HandshakeState {
         ReadingProtocolVersion,
@@ -0,0 +1,336 @@
+#include "zrleencoder.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QtEndian>
+#include <cstring>
+
+static const int ZRLE_TILE_SIZE = 64;
+static const int MAX_PALETTE = 127;       // palette RLE, the index has to leave the top bit free
+static const int MAX_PACKED_PALETTE = 16; // packed palette, 4 bits per index at most
+static const int PALETTE_SLOTS = 256;     // hash table, a power of two well above MAX_PALETTE
+
+// tile subencodings, palette RLE is ZRLE_PLAIN_RLE plus the palette size and packed
+// palette the size alone
+static const uchar ZRLE_RAW = 0;
+static const uchar ZRLE_SOLID = 1;
+static const uchar ZRLE_PLAIN_RLE = 128;
+
+// room for the sync flush marker and anything deflateParams() emits
+static const int DEFLATE_SLACK = 64;
+
+// where the CPIXEL bytes sit inside a pixel in the client's format. 32 bit true colour
+// with every channel in the low or the high three bytes drops the unused byte
+struct CpixelLayout
+{
+    int offset = 0;
+    int size = 4;
+};
+
+static CpixelLayout cpixelLayout(const PixelFormat& format) {
+    CpixelLayout layout;
+    layout.size = format.bytesPerPixel();
+    if (format.bitsPerPixel != 32 || !format.trueColour || format.depth > 24) return layout;
+
+    const quint32 bits = (quint32(format.redMax) << format.redShift) | (quint32(format.greenMax) << format.greenShift)
+                         | (quint32(format.blueMax) << format.blueShift);
+    if (bits < (1u << 24)) {
+        // low three bytes: the first three in memory on little endian, the last three on big
+        layout.size = 3;
+        layout.offset = format.bigEndian ? 1 : 0;
+    } else if (!(bits & 0xff)) {
+        layout.size = 3;
+        layout.offset = format.bigEndian ? 0 : 1;
+    }
+    return layout;
+}
+
+// count captured pixels as CPIXELs to dst, count is at most a tile row or a palette
+static void putCpixels(const PixelConverter& converter, const CpixelLayout& layout, const quint32* src, int count,
+                       uchar* dst) {
+    const int bytesPerPixel = converter.format().bytesPerPixel();
+    if (layout.size == bytesPerPixel) {
+        if (converter.isIdentity())
+            std::memcpy(dst, src, size_t(count) * 4);
+        else
+            converter.convert(src, dst, count);
+        return;
+    }
+
+    uchar pixels[MAX_PALETTE * 4]; // a palette is longer than a tile row
+    const uchar* converted = reinterpret_cast<const uchar*>(src);
+    if (!converter.isIdentity()) {
+        converter.convert(src, pixels, count);
+        converted = pixels;
+    }
+    for (int i = 0; i < count; ++i)
+        std::memcpy(dst + i * layout.size, converted + i * 4 + layout.offset, layout.size);
+}
+
+// run lengths go out as length - 1 in bytes of 255 and a final byte below 255
+static int runLengthBytes(int length) {
+    return (length - 1) / 255 + 1;
+}
+
+static uchar* putRunLength(int length, uchar* dst) {
+    int remaining = length - 1;
+    while (remaining >= 255) {
+        *dst++ = 255;
+        remaining -= 255;
+    }
+    *dst++ = uchar(remaining);
+    return dst;
+}
+
+// colour to index for one tile, open addressing on a hash of the pixel
+struct TilePalette
+{
+    quint32 colours[MAX_PALETTE];
+    int size = 0;
+    bool overflow = false;
+    quint32 keys[PALETTE_SLOTS];
+    qint8 indices[PALETTE_SLOTS];
+
+    TilePalette() { std::memset(indices, -1, sizeof(indices)); }
+
+    static int slotFor(quint32 pixel) { return int((pixel * 2654435761u) >> 24); }
+
+    int indexOf(quint32 pixel) const {
+        for (int slot = slotFor(pixel);; slot = (slot + 1) & (PALETTE_SLOTS - 1)) {
+            if (indices[slot] < 0 || keys[slot] == pixel) return indices[slot];
+        }
+    }
+
+    void insert(quint32 pixel) {
+        int slot = slotFor(pixel);
+        for (; indices[slot] >= 0; slot = (slot + 1) & (PALETTE_SLOTS - 1)) {
+            if (keys[slot] == pixel) return;
+        }
+        if (size == MAX_PALETTE) {
+            overflow = true;
+            return;
+        }
+        keys[slot] = pixel;
+        indices[slot] = qint8(size);
+        colours[size++] = pixel;
+    }
+};
+
+static void encodeTile(const quint32* pixels, qsizetype stride, int width, int height,
+                       const PixelConverter& converter, const CpixelLayout& layout, OutgoingRect& out) {
+    const int cpixel = layout.size;
+
+    // one pass for the palette and the runs. Runs carry on from one row to the next
+    TilePalette palette;
+    qsizetype plainRleBytes = 0;
+    qsizetype paletteRleBytes = 0;
+    quint32 runPixel = pixels[0];
+    int runLength = 0;
+    palette.insert(runPixel);
+    auto endRun = [&]() {
+        plainRleBytes += cpixel + runLengthBytes(runLength);
+        paletteRleBytes += runLength == 1 ? 1 : 1 + runLengthBytes(runLength);
+    };
+    for (int y = 0; y < height; ++y) {
+        const quint32* row = pixels + y * stride;
+        for (int x = 0; x < width; ++x) {
+            if (row[x] == runPixel) {
+                ++runLength;
+                continue;
+            }
+            endRun();
+            runPixel = row[x];
+            runLength = 1;
+            if (!palette.overflow) palette.insert(runPixel);
+        }
+    }
+    endRun();
+
+    // everything is measured exactly, the smallest form wins
+    const qsizetype rawBytes = qsizetype(width) * height * cpixel;
+    uchar subencoding = ZRLE_RAW;
+    qsizetype bytes = rawBytes;
+    int indexBits = 0;
+    if (!palette.overflow && palette.size == 1) {
+        subencoding = ZRLE_SOLID;
+        bytes = cpixel;
+    } else {
+        if (plainRleBytes < bytes) {
+            subencoding = ZRLE_PLAIN_RLE;
+            bytes = plainRleBytes;
+        }
+        if (!palette.overflow) {
+            const qsizetype paletteBytes = qsizetype(palette.size) * cpixel;
+            if (paletteBytes + paletteRleBytes < bytes) {
+                subencoding = uchar(ZRLE_PLAIN_RLE + palette.size);
+                bytes = paletteBytes + paletteRleBytes;
+            }
+            if (palette.size <= MAX_PACKED_PALETTE) {
+                const int bits = palette.size == 2 ? 1 : palette.size <= 4 ? 2 : 4;
+                const qsizetype packedBytes = paletteBytes + qsizetype(height) * ((width * bits + 7) / 8);
+                if (packedBytes <= bytes) {
+                    subencoding = uchar(palette.size);
+                    bytes = packedBytes;
+                    indexBits = bits;
+                }
+            }
+        }
+    }
+
+    uchar* dst = reinterpret_cast<uchar*>(out.grow(1 + bytes));
+    out.bytesCopied += 1 + bytes;
+    *dst++ = subencoding;
+
+    if (subencoding == ZRLE_RAW) {
+        for (int y = 0; y < height; ++y, dst += width * cpixel)
+            putCpixels(converter, layout, pixels + y * stride, width, dst);
+        return;
+    }
+    if (subencoding == ZRLE_SOLID) {
+        putCpixels(converter, layout, pixels, 1, dst);
+        return;
+    }
+    if (subencoding != ZRLE_PLAIN_RLE) {
+        putCpixels(converter, layout, palette.colours, palette.size, dst);
+        dst += palette.size * cpixel;
+    }
+
+    if (indexBits) {
+        // packed palette, most significant bits first, every row starts on a new byte
+        for (int y = 0; y < height; ++y) {
+            const quint32* row = pixels + y * stride;
+            uint byte = 0;
+            int used = 0;
+            for (int x = 0; x < width; ++x) {
+                byte = (byte << indexBits) | uint(palette.indexOf(row[x]));
+                used += indexBits;
+                if (used == 8) {
+                    *dst++ = uchar(byte);
+                    byte = 0;
+                    used = 0;
+                }
+            }
+            if (used) *dst++ = uchar(byte << (8 - used));
+        }
+        return;
+    }
+
+    // plain or palette RLE, the same runs as measured above
+    const bool plain = subencoding == ZRLE_PLAIN_RLE;
+    runPixel = pixels[0];
+    runLength = 0;
+    auto putRun = [&]() {
+        if (plain) {
+            putCpixels(converter, layout, &runPixel, 1, dst);
+            dst = putRunLength(runLength, dst + cpixel);
+        } else if (runLength == 1) {
+            *dst++ = uchar(palette.indexOf(runPixel));
+        } else {
+            *dst++ = uchar(palette.indexOf(runPixel) | 128);
+            dst = putRunLength(runLength, dst);
+        }
+    };
+    for (int y = 0; y < height; ++y) {
+        const quint32* row = pixels + y * stride;
+        for (int x = 0; x < width; ++x) {
+            if (row[x] == runPixel) {
+                ++runLength;
+                continue;
+            }
+            putRun();
+            runPixel = row[x];
+            runLength = 1;
+        }
+    }
+    putRun();
+}
+
+void encodeZrleTiles(const QImage& image, const QRect& rect, const PixelConverter& converter, OutgoingRect& out) {
+    const CpixelLayout layout = cpixelLayout(converter.format());
+    const qsizetype stride = image.bytesPerLine() / 4;
+    for (int ty = rect.top(); ty <= rect.bottom(); ty += ZRLE_TILE_SIZE) {
+        const int height = qMin(ZRLE_TILE_SIZE, rect.bottom() - ty + 1);
+        for (int tx = rect.left(); tx <= rect.right(); tx += ZRLE_TILE_SIZE) {
+            const int width = qMin(ZRLE_TILE_SIZE, rect.right() - tx + 1);
+            const quint32* pixels = reinterpret_cast<const quint32*>(image.constScanLine(ty)) + tx;
+            encodeTile(pixels, stride, width, height, converter, layout, out);
+        }
+    }
+}
+
+ZrleStream::ZrleStream() {
+    std::memset(&m_stream, 0, sizeof(m_stream));
+    m_ready = deflateInit(&m_stream, m_level) == Z_OK;
+    m_streamLevel = m_level;
+    if (!m_ready)
+        qWarning() << "[Server] zlib init failed:" << (m_stream.msg ? m_stream.msg : "");
+}
+
+ZrleStream::~ZrleStream() {
+    if (m_ready) deflateEnd(&m_stream);
+}
+
+qint64 ZrleStream::takeDeflateNsecs() {
+    const qint64 nsecs = m_deflateNsecs;
+    m_deflateNsecs = 0;
+    return nsecs;
+}
+
+bool ZrleStream::deflateRect(const QRect& rect, const OutgoingRect& tiles, OutgoingRect& out) {
+    if (!m_ready) return false;
+
+    QElapsedTimer timer;
+    timer.start();
+    out.appendRectHeader(rect, ENCODING_ZRLE);
+    const qsizetype lengthOffset = out.buffer.size();
+    out.grow(4);
+
+    // deflateBound() holds for the whole input in one go, the loops below still grow the
+    // output if a flush ever needs more
+    const qsizetype start = lengthOffset + 4;
+    qsizetype reserved = qsizetype(deflateBound(&m_stream, uLong(tiles.wireSize()))) + DEFLATE_SLACK;
+    out.grow(reserved);
+    auto ensureOutput = [&]() {
+        const qsizetype used = reserved - m_stream.avail_out;
+        if (m_stream.avail_out == 0) {
+            out.grow(reserved);
+            reserved *= 2;
+        }
+        m_stream.next_out = reinterpret_cast<Bytef*>(out.buffer.data() + start + used);
+        m_stream.avail_out = uInt(reserved - used);
+    };
+    m_stream.avail_out = uInt(reserved);
+    ensureOutput();
+
+    // a new CompressLevel only takes effect between rectangles, the stream stays the same.
+    // No input is pending here, anything deflateParams() flushes goes ahead of the tiles.
+    // On Z_BUF_ERROR the old level stays and the next rectangle tries again
+    if (m_streamLevel != m_level) {
+        m_stream.avail_in = 0;
+        const int result = deflateParams(&m_stream, m_level, Z_DEFAULT_STRATEGY);
+        if (result == Z_OK)
+            m_streamLevel = m_level;
+        else if (result != Z_BUF_ERROR)
+            qWarning() << "[Server] zlib deflateParams failed:" << result;
+    }
+
+    for (const IoSegment& segment : tiles.segments) {
+        m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(tiles.segmentData(segment)));
+        m_stream.avail_in = uInt(segment.size);
+        while (m_stream.avail_in > 0) {
+            ensureOutput();
+            deflate(&m_stream, Z_NO_FLUSH);
+        }
+    }
+    // a sync flush ends on a byte boundary with everything so far decodable
+    do {
+        ensureOutput();
+        deflate(&m_stream, Z_SYNC_FLUSH);
+    } while (m_stream.avail_out == 0);
+
+    const qsizetype compressed = reserved - m_stream.avail_out;
+    out.shrink(m_stream.avail_out);
+    out.bytesCopied += compressed;
+    qToBigEndian<quint32>(quint32(compressed), out.buffer.data() + lengthOffset);
+    m_deflateNsecs += timer.nsecsElapsed();
+    return true;
+}
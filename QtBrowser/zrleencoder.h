@@ -0,0 +1,56 @@
+#ifndef ZRLEENCODER_H
+#define ZRLEENCODER_H
+
+#include <QImage>
+#include <QRect>
+#include <zlib.h>
+#include "pixelformat.h"
+#include "rfboutput.h"
+
+static const qint32 ENCODING_ZRLE = 16;
+// CompressLevel pseudo encodings, -256 is level 0 up to -247 for level 9
+static const qint32 ENCODING_COMPRESS_LEVEL_0 = -256;
+static const qint32 ENCODING_COMPRESS_LEVEL_9 = -247;
+
+// the uncompressed ZRLE data of one rectangle into out, no header: 64x64 tiles, each
+// one solid, packed palette, RLE, palette RLE or raw, whichever is smallest, with
+// CPIXELs. Thread safe, the workers run it for their tiles at once and the session
+// deflates the results in wire order
+void encodeZrleTiles(const QImage& image, const QRect& rect, const PixelConverter& converter, OutgoingRect& out);
+
+// ZrleStream is the one zlib stream a ZRLE connection has. The client inflates every
+// rectangle with the same stream, so it lives as long as the session and the
+// dictionary carries over from update to update. Session thread only
+class ZrleStream
+{
+public:
+    ZrleStream();
+    ~ZrleStream();
+    ZrleStream(const ZrleStream&) = delete;
+    ZrleStream& operator=(const ZrleStream&) = delete;
+
+    // 0 to 9, applied before the next rectangle
+    void setLevel(int level) { m_level = level; }
+    int level() const { return m_level; }
+
+    // false if zlib never came up, sessions should not pick ZRLE then
+    bool ready() const { return m_ready; }
+
+    // the rectangle header, the length and tiles (from encodeZrleTiles()) deflated
+    // into out, flushed so the client can decode it without waiting for more. Returns
+    // false and leaves out alone when the stream is unusable, the rectangle has to go
+    // out in another encoding
+    bool deflateRect(const QRect& rect, const OutgoingRect& tiles, OutgoingRect& out);
+
+    // time spent in zlib since the last call
+    qint64 takeDeflateNsecs();
+
+private:
+    z_stream m_stream;
+    bool m_ready = false;
+    int m_level = 6; // zlib's own default
+    int m_streamLevel = 6;
+    qint64 m_deflateNsecs = 0;
+};
+
+#endif // ZRLEENCODER_H
@@ -4,6 +4,7 @@
 #include <QLineEdit>
 #include <QSpinBox>
 #include <QPushButton>
+#include <QCheckBox>
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QWidget>
@@ -35,8 +36,12 @@ MainWindow::MainWindow(QWidget *parent)
     connectButton = new QPushButton("Connect", this);
     disconnectButton = new QPushButton("Disconnect", this);
     disconnectButton->setEnabled(false);
+    // off means one request per update, handy for comparing the two over a slow link
+    continuousCheck = new QCheckBox("Continuous updates", this);
+    continuousCheck->setChecked(true);
     buttonLayout->addWidget(connectButton);
     buttonLayout->addWidget(disconnectButton);
+    buttonLayout->addWidget(continuousCheck);
 
     viewer = new VncViewerWidget(this);
     viewer->setMinimumSize(320, 240);
@@ -70,10 +75,17 @@ void MainWindow::onConnectClicked() {
     QString pwd = passwordEdit->text().trimmed();
 
     client = new VncClient(host, port, user, pwd);
+    client->setContinuousUpdates(continuousCheck->isChecked());
 
     connect(client, &VncClient::frameUpdated,
             viewer, &VncViewerWidget::onFrameUpdated);
 
+    // the server renders at our window size instead of us scaling its picture. The
+    // client picks the size up from its own thread, so this can stay a direct call
+    connect(viewer, &VncViewerWidget::viewportResized,
+            client, &VncClient::requestDesktopSize, Qt::DirectConnection);
+    client->requestDesktopSize(viewer->size());
+
     connect(client, &VncClient::errorOccured,
             this, &MainWindow::onClientError,
             Qt::QueuedConnection);
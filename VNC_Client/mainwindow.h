@@ -8,6 +8,7 @@ class VncClient;
 class QLineEdit;
 class QSpinBox;
 class QPushButton;
+class QCheckBox;
 
 class MainWindow : public QMainWindow {
     Q_OBJECT
@@ -27,6 +28,7 @@ private:
     QLineEdit *passwordEdit;
     QPushButton *connectButton;
     QPushButton *disconnectButton;
+    QCheckBox *continuousCheck;
     VncViewerWidget *viewer;
     VncClient *client;
 };
@@ -6,6 +6,13 @@
 
 // protocol constants
 static const QByteArray PROTOCOL_VERSION = "RFB 003.008\n";
+static const qint32 ENCODING_RAW = 0;
+static const qint32 ENCODING_DESKTOP_SIZE = -223;
+static const qint32 ENCODING_EXTENDED_DESKTOP_SIZE = -308;
+static const qint32 ENCODING_FENCE = -312;
+static const qint32 ENCODING_CONTINUOUS_UPDATES = -313;
+static const quint32 FENCE_REQUEST = 0x80000000;
+static const quint32 FENCE_SUPPORTED = 0x7; // block before, block after, sync next
 
 VncClient::VncClient(const QString &host, int port,
                      const QString &username,
@@ -18,7 +25,10 @@ VncClient::VncClient(const QString &host, int port,
     m_password(password),
     m_socket(nullptr),
     m_running(false),
-    m_isUpdating(false)
+    m_isUpdating(false),
+    m_serverCanResize(false),
+    m_continuousWanted(false),
+    m_continuousActive(false)
 {
     m_socket = new QTcpSocket();
 }
@@ -44,7 +54,8 @@ bool VncClient::readBytes(char *buffer, int length, int timeout) {
 
     int totalRead = 0;
     while (totalRead < length && m_running) {
-        if (!m_socket->waitForReadyRead(timeout)) {
+        // only block when nothing is buffered, otherwise we would wait for bytes we already have
+        if (m_socket->bytesAvailable() == 0 && !m_socket->waitForReadyRead(timeout)) {
             qWarning() << "Timeout while waiting for" << length - totalRead << "bytes";
             return false;
         }
@@ -210,14 +221,118 @@ bool VncClient::processServerInit() {
     return true;
 }
 
-void VncClient::requestFramebufferUpdate() {
+void VncClient::sendSetEncodings() {
+    QByteArray message;
+    QDataStream out(&message, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+
+    // raw pixels, and the server may resize us (or let us resize it)
+    QList<qint32> encodings = { ENCODING_RAW, ENCODING_EXTENDED_DESKTOP_SIZE, ENCODING_DESKTOP_SIZE };
+    if (m_continuousWanted)
+        encodings << ENCODING_CONTINUOUS_UPDATES << ENCODING_FENCE;
+    out << (quint8)2 << (quint8)0 << (quint16)encodings.size();
+    for (qint32 encoding : encodings)
+        out << encoding;
+
+    if (!writeData(message))
+        emit errorOccured("Failed to send SetEncodings");
+}
+
+void VncClient::requestDesktopSize(const QSize &size) {
+    QMutexLocker locker(&m_resizeMutex);
+    m_pendingDesktopSize = size;
+}
+
+void VncClient::sendPendingDesktopSize() {
+    if (!m_serverCanResize)
+        return;
+    QSize size;
+    {
+        QMutexLocker locker(&m_resizeMutex);
+        size = m_pendingDesktopSize;
+        m_pendingDesktopSize = QSize();
+    }
+    if (size.isEmpty() || size == m_framebufferImage.size())
+        return;
+
+    QByteArray message;
+    QDataStream out(&message, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+
+    // SetDesktopSize with one screen covering all of it
+    out << (quint8)251 << (quint8)0 << (quint16)size.width() << (quint16)size.height();
+    out << (quint8)1 << (quint8)0;
+    out << (quint32)0 << (quint16)0 << (quint16)0
+        << (quint16)size.width() << (quint16)size.height() << (quint32)0;
+
+    if (!writeData(message))
+        emit errorOccured("Failed to send SetDesktopSize");
+    else
+        qDebug() << "[Client] Sent SetDesktopSize:" << size;
+}
+
+void VncClient::sendEnableContinuousUpdates() {
+    QByteArray message;
+    QDataStream out(&message, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+
+    out << (quint8)150 << (quint8)1 << (quint16)0 << (quint16)0
+        << (quint16)m_framebufferImage.width() << (quint16)m_framebufferImage.height();
+
+    if (!writeData(message))
+        emit errorOccured("Failed to send EnableContinuousUpdates");
+    else
+        qDebug() << "[Client] Sent EnableContinuousUpdates";
+}
+
+bool VncClient::handleEndOfContinuousUpdates() {
+    if (m_continuousActive) {
+        // the server stopped pushing, back to asking for every update
+        m_continuousActive = false;
+        requestFramebufferUpdate();
+    } else if (m_continuousWanted) {
+        // the first one just tells us the server can push
+        m_continuousActive = true;
+        sendEnableContinuousUpdates();
+    }
+    return true;
+}
+
+bool VncClient::handleFence() {
+    // the type byte is gone, then 3 bytes padding, the flags and the payload length
+    char header[8];
+    if (!readBytes(header, 8)) {
+        emit errorOccured("Failed to read Fence");
+        return false;
+    }
+    const quint32 flags = qFromBigEndian(*reinterpret_cast<quint32*>(header + 3));
+    QByteArray payload(quint8(header[7]), Qt::Uninitialized);
+    if (!payload.isEmpty() && !readBytes(payload.data(), payload.size())) {
+        emit errorOccured("Failed to read Fence payload");
+        return false;
+    }
+    if (!(flags & FENCE_REQUEST))
+        return true;
+
+    // we handle everything in order on this thread, so answering right away meets
+    // every flag we support
+    QByteArray message;
+    QDataStream out(&message, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+    out << (quint8)248 << (quint8)0 << (quint8)0 << (quint8)0
+        << (quint32)(flags & FENCE_SUPPORTED) << (quint8)payload.size();
+    out.writeRawData(payload.constData(), payload.size());
+    return writeData(message);
+}
+
+void VncClient::requestFramebufferUpdate(bool incremental) {
     QByteArray request;
     QDataStream out(&request, QIODevice::WriteOnly);
     out.setByteOrder(QDataStream::BigEndian);
 
     // RFB FramebufferUpdateRequest message structure
     out << (quint8)3;    // message type (3 = FramebufferUpdateRequest)
-    out << (quint8)1;    // incremental flag (1 = only send changes)
+    out << (quint8)(incremental ? 1 : 0); // incremental flag (1 = only send changes)
     out << (quint16)0    // x position
         << (quint16)0    // y position
         << (quint16)m_framebufferImage.width()
@@ -248,12 +363,17 @@ void VncClient::run() {
         return;
     }
 
+    sendSetEncodings();
+
     // request full framebuffer update after handshake
-    requestFramebufferUpdate();
+    requestFramebufferUpdate(false);
     qDebug() << "[Client] Sent initial FramebufferUpdateRequest.";
 
     // now enter the main loop to process messages
     while (m_running) {
+        // window resizes pile up in between, this sends the last one
+        sendPendingDesktopSize();
+
         if (!m_socket->waitForReadyRead(100)) {
             continue;
         }
@@ -285,9 +405,13 @@ bool VncClient::processServerMessage() {
 
     qDebug() << "[Client] Received message type:" << static_cast<int>(msgType);
 
-    switch (msgType) {
+    switch (static_cast<quint8>(msgType)) {
     case 0: // FramebufferUpdate
         return handleFramebufferUpdate();
+    case 150: // EndOfContinuousUpdates
+        return handleEndOfContinuousUpdates();
+    case 248: // Fence
+        return handleFence();
     default:
         qWarning() << "Unhandled message type:" << static_cast<int>(msgType);
         return false;
@@ -296,76 +420,97 @@ bool VncClient::processServerMessage() {
 
 
 bool VncClient::handleFramebufferUpdate() {
-    qDebug() << "Start of function";
-    char header[4];
-    if (!readBytes(header, 4)) {
+    // the message type byte was already consumed by processServerMessage(),
+    // what is left of the header is one byte of padding and a big endian rect count
+    char header[3];
+    if (!readBytes(header, 3)) {
         emit errorOccured("Failed to read FramebufferUpdate header");
         return false;
     }
 
-    quint8 messageType = static_cast<quint8>(header[0]);
-    quint8 padding     = static_cast<quint8>(header[1]);
-    quint16 numRects   = (static_cast<quint8>(header[3]) << 8) | static_cast<quint8>(header[2]);
-
-    qDebug() << "[Client] messageType=" << messageType
-             << "padding=" << padding
-             << "numRects=" << numRects;
-
-    if (messageType != 0) {
-        emit errorOccured(QString("Expected FramebufferUpdate (type=0), got %1").arg(messageType));
-        return false;
-    }
-
-    if (numRects != 1) {
-        emit errorOccured(QString("Expected 1 rectangle, got %1").arg(numRects));
-        return false;
-    }
-
-    // next 12 bytes are for the rectangle header
-    char rectHeader[12];
-    if (!readBytes(rectHeader, 12)) {
-        emit errorOccured("Failed to read rectangle header");
-        return false;
-    }
-
-    quint16 x = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader));
-    quint16 y = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader + 2));
-    quint16 w = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader + 4));
-    quint16 h = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader + 6));
-    qint32 encoding = qFromBigEndian(*reinterpret_cast<qint32*>(rectHeader + 8)); //reads in big endian finally (the error beleive it or not was because the project wasnt being rebuilt..)
+    quint16 numRects = qFromBigEndian(*reinterpret_cast<quint16*>(header + 1));
+    qDebug() << "[Client] numRects=" << numRects;
+    bool resized = false;
 
-    if (encoding != 0) {
-        emit errorOccured(QString("Unsupported encoding: %1").arg(encoding));
-        return false;
-    }
+    for (int i = 0; i < numRects; ++i) {
+        // next 12 bytes are for the rectangle header
+        char rectHeader[12];
+        if (!readBytes(rectHeader, 12)) {
+            emit errorOccured("Failed to read rectangle header");
+            return false;
+        }
 
-    const int bytesNeeded = w * h * 4;
-    QByteArray pixelData;
-    pixelData.reserve(bytesNeeded);
+        quint16 x = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader));
+        quint16 y = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader + 2));
+        quint16 w = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader + 4));
+        quint16 h = qFromBigEndian(*reinterpret_cast<quint16*>(rectHeader + 6));
+        qint32 encoding = qFromBigEndian(*reinterpret_cast<qint32*>(rectHeader + 8)); //reads in big endian finally (the error beleive it or not was because the project wasnt being rebuilt..)
+
+        if (encoding == ENCODING_EXTENDED_DESKTOP_SIZE || encoding == ENCODING_DESKTOP_SIZE) {
+            // x and y are the reason and the status here, then the screen layout follows
+            if (encoding == ENCODING_EXTENDED_DESKTOP_SIZE) {
+                char screenHeader[4];
+                if (!readBytes(screenHeader, 4)) {
+                    emit errorOccured("Failed to read screen layout");
+                    return false;
+                }
+                QByteArray screens(quint8(screenHeader[0]) * 16, Qt::Uninitialized);
+                if (!screens.isEmpty() && !readBytes(screens.data(), screens.size())) {
+                    emit errorOccured("Failed to read screen layout");
+                    return false;
+                }
+                m_serverCanResize = true;
+                if (y != 0) {
+                    qWarning() << "[Client] Server refused our desktop size, status:" << y;
+                    continue;
+                }
+            }
+            qDebug() << "[Client] Desktop resized to" << w << "x" << h;
+            m_framebufferImage = QImage(w, h, QImage::Format_RGB32);
+            m_framebufferImage.fill(Qt::black);
+            resized = true;
+            continue;
+        }
 
-    while (pixelData.size() < bytesNeeded) {
-        if (!m_socket->waitForReadyRead(1000)) {
-            emit errorOccured("Timeout waiting for pixel data");
+        if (encoding != 0) {
+            emit errorOccured(QString("Unsupported encoding: %1").arg(encoding));
             return false;
         }
-        pixelData.append(m_socket->read(bytesNeeded - pixelData.size()));
-    }
 
-    if (pixelData.size() != bytesNeeded) {
-        emit errorOccured(QString("Incomplete pixel data. Expected %1, got %2")
-                              .arg(bytesNeeded).arg(pixelData.size()));
-        return false;
-    }
+        const int bytesNeeded = w * h * 4;
+        QByteArray pixelData;
+        pixelData.reserve(bytesNeeded);
+
+        while (pixelData.size() < bytesNeeded) {
+            if (m_socket->bytesAvailable() == 0 && !m_socket->waitForReadyRead(1000)) {
+                emit errorOccured("Timeout waiting for pixel data");
+                return false;
+            }
+            pixelData.append(m_socket->read(bytesNeeded - pixelData.size()));
+        }
 
-    QImage frame(reinterpret_cast<const uchar*>(pixelData.constData()),
-                 w, h, QImage::Format_RGBA8888);
-    frame.save("client_received.png");
+        // the server sends its native 32 bit layout (0xffRRGGBB words), which is what
+        // Format_RGB32 is on the same byte order
+        QImage rect(reinterpret_cast<const uchar*>(pixelData.constData()),
+                    w, h, QImage::Format_RGB32);
 
-    QPainter painter(&m_framebufferImage);
-    painter.drawImage(x, y, frame);
-    painter.end();
+        QPainter painter(&m_framebufferImage);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.drawImage(x, y, rect);
+        painter.end();
+    }
 
     emit frameUpdated(m_framebufferImage.copy());
+
+    // the server only sends when asked, so ask for the next round of changes right away.
+    // After a resize nothing we had is valid anymore, so ask for all of it. In push mode
+    // the changes come anyway, only the new area has to be asked for
+    if (!m_continuousActive) {
+        requestFramebufferUpdate(!resized);
+    } else if (resized) {
+        requestFramebufferUpdate(false);
+        sendEnableContinuousUpdates();
+    }
     return true;
 }
 
@@ -3,6 +3,8 @@
 
 #include <QThread>
 #include <QImage>
+#include <QMutex>
+#include <QSize>
 #include <QString>
 #include <QTcpSocket>
 
@@ -19,6 +21,12 @@ public:
     void disconnectFromServer();
     bool processServerMessage();
     bool handleFramebufferUpdate();
+    // asks the server to resize its desktop to our window, safe to call from any
+    // thread. Waits until the server said it can do that, only the newest size is sent
+    void requestDesktopSize(const QSize &size);
+    // push mode: once the server confirms it supports it, it sends changes as they
+    // happen instead of one update per request. Set before start()
+    void setContinuousUpdates(bool enabled) { m_continuousWanted = enabled; }
 
 public slots:
     void doDisconnect();
@@ -41,13 +49,24 @@ private:
     QImage m_framebufferImage;
     bool m_running;
     bool m_isUpdating;
+    // set once the server sent an ExtendedDesktopSize rectangle
+    bool m_serverCanResize;
+    QMutex m_resizeMutex;
+    QSize m_pendingDesktopSize;
+    bool m_continuousWanted;
+    bool m_continuousActive;
 
     // helper methods for protocol communication
     bool readBytes(char *buffer, int length, int timeout = 3000);
     bool writeData(const QByteArray &data);
     bool performHandshake();
     bool processServerInit();
-    void requestFramebufferUpdate();
+    void requestFramebufferUpdate(bool incremental = true);
+    void sendSetEncodings();
+    void sendPendingDesktopSize();
+    void sendEnableContinuousUpdates();
+    bool handleEndOfContinuousUpdates();
+    bool handleFence();
 };
 
 #endif // VNCCLIENT_H
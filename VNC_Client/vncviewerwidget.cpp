@@ -34,6 +34,7 @@ void VncViewerWidget::initializeGL() {
 
 void VncViewerWidget::resizeGL(int width, int height) {
     glViewport(0, 0, width, height);
+    emit viewportResized(QSize(width, height));
 }
 
 void VncViewerWidget::paintGL() {
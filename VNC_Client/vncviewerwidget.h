@@ -16,6 +16,10 @@ public slots:
     // slot to receive new frame images from the client
     void onFrameUpdated(const QImage& frame);
 
+signals:
+    // the area the frame is drawn into, the client asks the server for this size
+    void viewportResized(const QSize& size);
+
 protected:
     void initializeGL() override;
     void resizeGL(int width, int height) override;